@@ -4,35 +4,168 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+// the wave kernel uses the widest vectors the compiler allows, build with -O3 -march=native for AVX2
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WAVE_WIDTH 8
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define WAVE_WIDTH 4
+#else
+#define WAVE_WIDTH 1
+#endif
+// -march=native turns a * b + c into fused multiply-adds, which round once where an SSE2 build rounds twice.
+// keep them apart so every build renders the same bytes and 'bench' checksums compare across machines
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
 
-#define M_PI_2		1.57079632679489661923
 #define M_PI		3.14159265358979323846
-#define HIGH_SINE UINT16_MAX
-#define ISR_HZ 40000 
+// sample rate and cycle table size can be set at build time, e.g. -DISR_HZ=25000 -DNUM_CYCLES=1024
+#ifndef ISR_HZ
+#define ISR_HZ 40000
+#endif
 #define POS_ARR_LEN ISR_HZ
+#ifndef NUM_CYCLES
 #define NUM_CYCLES 64
+#endif
+#define MASK_WORDS ((NUM_CYCLES + 63) / 64)
+#define BLOCK_PAD 8 // the wave kernel works in whole vectors, so spans can spill this far past the block
 #define INSTRUCTIONS_FILE "instructions.txt"
+#define SHOW_FILE "show.bin"
+#define RENDER_FILE "render.bin"
+#define RENDER_MAGIC "LFRM"
+#define RENDER_VERSION 1
+#define REPLAY_CHUNK 8192 // bytes per write when replaying a render
+#define BENCH_SECONDS 4    // length of each synthetic show 'bench' renders
+#define SHOW_MAGIC "LSHW"
+#define SHOW_VERSION 2
+#define RING_LEN (1 << 17) // frames the ring can hold between the renderer and the serial writer
+#define RING_BLOCKS 2      // blocks the renderer may get ahead of the serial writer
+#define STAMP_LEN 8        // blocks in flight whose admission time is kept for the latency figures
+#define WRITE_CHUNK 32     // frames packed and written at a time, same as pack_arr() in serial.c
+#define SEEK_STRIDE ISR_HZ // samples between the checkpoints of the seek index
+#define JOB_SAMPLES 4096   // small blocks go to the render threads this many samples' worth at a time
+#define CHECK_WAVE_POINTS (1 << 22) // arguments 'check-wave' tries the wave kernel on
+#define WAVE_ERROR 5e-7    // most a wave may be off from sin() / cos()
+#define LUT_ERROR 2e-4     // most a wave may be off from the old lookup table, which is off by about 1e-4 itself
+#define LUT_HIGH UINT16_MAX
+#ifdef _WIN32
+#define SERIAL_DEVICE "\\\\.\\COM3"
+#else
+#define SERIAL_DEVICE "/dev/ttyUSB0"
+#endif
 
 enum types {ATTR, POS, COLOR, ROTATE};
+enum targets {TARGET_X, TARGET_Y, TARGET_R, TARGET_G, TARGET_B, TARGET_ROTATE, TARGET_HIGH, TARGET_LOW, TARGET_PHASE, TARGET_AUDIO_L, TARGET_AUDIO_R};
+enum waves {SINE, COSINE};
 
 
 typedef struct __attribute__((packed))
 {
-    bool alive;
     uint32_t start;
     uint32_t end;
     float low;
     float high;
     float phase;
     float hz;
-    void *target;
+    uint64_t phase_acc; // turns since start, 1 << 64 is one full turn
+    uint64_t phase_inc; // turns per sample, same scale
     uint8_t target_type;
-    float (*wave)(const float);
+    uint8_t wave;       // enum waves
     float center_x;
     float center_y;
+    uint32_t id;        // position of the instruction in the show
+    uint32_t target_id; // for ATTR: the instruction being modulated
+    uint8_t target_var; // enum targets
+    int16_t target_slot; // for ATTR: the target's slot, -1 until it is loaded
+    int16_t older;       // the cycle loaded before this one, -1 for the oldest
+    int16_t newer;       // the cycle loaded after this one, -1 for the newest
+    int16_t prev_writer; // for ATTR: the other ATTR cycles aimed at the same instruction, -1 at either end
+    int16_t next_writer;
 }
 Cycle;
 
+_Static_assert(NUM_CYCLES <= 32767, "slots have to fit in Cycle.target_slot");
+
+// one bit per cycle slot
+typedef struct
+{
+    uint64_t w[MASK_WORDS];
+}
+SlotMask;
+
+// what the cycle table holds for one instruction: the slot running it and the ATTR cycles aimed at it.
+// open addressing, a live cycle brings in at most its own id and its target's, so the map is never over half full
+#define ID_SLOTS (4 * NUM_CYCLES)
+typedef struct
+{
+    uint32_t id;
+    int16_t slot;    // -1 while the instruction isn't loaded
+    int16_t writers; // the first ATTR cycle aimed at it, the rest follow Cycle.next_writer. -1 for none
+    bool used;
+}
+IdEntry;
+
+typedef struct
+{
+    IdEntry e[ID_SLOTS];
+}
+IdMap;
+
+// one instruction as stored in a compiled show file.
+// targets are symbolic so the file can be mapped and used without any fixups.
+typedef struct __attribute__((packed))
+{
+    uint32_t start;
+    uint32_t end;
+    float low;
+    float high;
+    float phase;
+    float hz;
+    float center_x;
+    float center_y;
+    uint32_t target_index; // the instruction an ATTR target points at
+    uint8_t target;        // enum targets
+    uint8_t wave;          // enum waves
+    uint16_t reserved;
+}
+CompiledCycle;
+
+typedef struct __attribute__((packed))
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t max_time;
+}
+ShowHeader;
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t len;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+}
+MappedFile;
+
 typedef struct __attribute__((packed))
 {
     uint16_t x_pos[POS_ARR_LEN];
@@ -40,6 +173,8 @@ typedef struct __attribute__((packed))
     uint8_t r[POS_ARR_LEN];
     uint8_t g[POS_ARR_LEN];
     uint8_t b[POS_ARR_LEN];
+    uint16_t audio_l[POS_ARR_LEN];
+    uint16_t audio_r[POS_ARR_LEN];
 }
 Laser;
 
@@ -49,248 +184,841 @@ typedef struct __attribute__((packed))
     uint16_t laser_x, laser_y, audio_l, audio_r;
 } LaserBytes;
 
-char instruction_file[256*256];
-long instructions_len;
-Cycle cycles[NUM_CYCLES] = {0};
-float sin_arr[(1<<16) + 2] = {0}; // added some padding just in case.
-uint8_t highest_index;
-Laser laser;
+// a rendered show is this header followed by 'frame_count' 8 byte frames in the
+// serial wire format, so it can be mapped and sent to the laser as is.
+typedef struct __attribute__((packed))
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t sample_rate;
+    uint32_t frame_count;
+}
+RenderHeader;
+
+// single producer / single consumer ring of frames on their way to the laser.
+// head and tail only ever count up, the difference is how many frames are waiting.
+typedef struct
+{
+    LaserBytes frames[RING_LEN];
+    _Atomic uint32_t head; // moved by the renderer
+    _Atomic uint32_t tail; // moved by the serial writer
+    _Atomic bool done;     // the renderer has pushed its last frame
+    uint32_t limit;        // frames the renderer may have waiting, RING_BLOCKS blocks
+    uint32_t stalls;       // times the renderer had to wait for room
+    uint32_t underruns;    // times the writer ran dry mid show
+    uint64_t frames_written;
+
+    // from a block's instructions being admitted to its last frame being written
+    uint64_t admitted_us[STAMP_LEN]; // by block number
+    uint64_t latency_sum_us, latency_max_us;
+    uint32_t blocks_written;
+}
+FrameRing;
+
+// which instructions are running every SEEK_STRIDE samples, so a seek only has to look at one
+// checkpoint's list and the instructions that start between it and the time sought.
+typedef struct
+{
+    uint32_t *first;        // checkpoint c's instructions are live[first[c]] up to live[first[c + 1]]
+    uint32_t *live;         // instruction numbers, in show order
+    uint32_t checkpoints;
+    uint32_t *writer_start; // by instruction, the earliest start of an ATTR instruction aimed at it
+}
+SeekIndex;
+
+#ifdef _WIN32
+typedef HANDLE SerialPort;
+#else
+typedef int SerialPort;
+#endif
+
+// one show per process. the show, the frame ring, the serial port and the seek index are process wide,
+// and ISR_HZ and NUM_CYCLES are fixed when the binary is built, so running two configurations or driving
+// two projectors means two processes. only the block solver below is per thread, so render threads can
+// share the one show.
+const CompiledCycle *instructions; // either mapped from a compiled show or parsed from text
+CompiledCycle *parsed_instructions;
+uint32_t num_instructions;
+MappedFile show_file;
+uint32_t dropped_instructions;
+_Thread_local bool replaying; // a render thread admitting again what the main thread already admitted and counted
+FrameRing ring;
+SerialPort serial_port;
+uint32_t block_len = ISR_HZ; // samples solved at a time, down to a few dozen for live use
+SeekIndex seek_index;
+
+// everything the block solver touches is per thread, so render threads can each solve their own block
+// slots never move once taken, so a slot number is a stable handle for as long as the cycle lives
+_Thread_local Cycle cycles[NUM_CYCLES] = {0};
+_Thread_local SlotMask live;      // bit i is set while cycles[i] is in use
+_Thread_local SlotMask attr_live; // the ATTR cycles in 'live'
+_Thread_local int newest = -1;    // the most recently loaded cycle, head of the older/newer list
+_Thread_local IdMap ids;          // live cycles and their writers by instruction id
+_Thread_local Laser laser;
+
+// scratch spans for the block solver
+_Thread_local float arg_buf[ISR_HZ + BLOCK_PAD] __attribute__((aligned(32)));
+_Thread_local float wave_buf[ISR_HZ + BLOCK_PAD] __attribute__((aligned(32)));
+_Thread_local float trig_buf[ISR_HZ + BLOCK_PAD] __attribute__((aligned(32)));
+
+// every ROTATE cycle of the block composed into one transform per sample,
+// x' = cos * x - sin * y + dx and y' = sin * x + cos * y + dy, applied once all positions are in
+_Thread_local float rot_cos[ISR_HZ] __attribute__((aligned(32)));
+_Thread_local float rot_sin[ISR_HZ] __attribute__((aligned(32)));
+_Thread_local float rot_dx[ISR_HZ] __attribute__((aligned(32)));
+_Thread_local float rot_dy[ISR_HZ] __attribute__((aligned(32)));
+_Thread_local bool rotated; // a ROTATE cycle ran this block
+
+// per sample values of cycle attributes that are being modulated by ATTR cycles.
+// index is slot * 3 + (target_var - TARGET_HIGH)
+_Thread_local float *mod_buf[NUM_CYCLES * 3];
+_Thread_local uint8_t *mod_written[NUM_CYCLES * 3];
+_Thread_local bool mod_used[NUM_CYCLES * 3];
+
+// the samples of the block a walk works out ATTR cycles at, in order. see walkCycle()
+_Thread_local uint32_t walk_samples[NUM_CYCLES];
+_Thread_local int walk_count;
+
+// 'bench' sets timing_stages to split the block solver into the wave kernel and the rotation
+_Thread_local bool timing_stages;
+_Thread_local uint64_t wave_ns, rotate_ns;
 
 
 const float x_convert = 1.0f / ((float)ISR_HZ) * M_PI * 2.0f;
+const float acc_convert = M_PI * 2.0f / 4294967296.0f; // top 32 bits of a phase accumulator to radians
 FILE *fp;
 
-void fillSineArr()
+static inline bool hasSlot(const SlotMask *const m, const int i)
 {
-    for (int i = 0; i < 1<<16; i++)
+    return m->w[i >> 6] >> (i & 63) & 1;
+}
+
+static inline void addSlot(SlotMask *const m, const int i)
+{
+    m->w[i >> 6] |= 1ULL << (i & 63);
+}
+
+// the lowest slot in 'm' from 'from' up, -1 if there is none
+static inline int nextSlot(const SlotMask *const m, const int from)
+{
+    if (from >= NUM_CYCLES)
+        return -1;
+    int w = from >> 6;
+    uint64_t bits = m->w[w] & (~0ULL << (from & 63));
+    while (bits == 0)
     {
-        sin_arr[i] = sinf(((double)i) / HIGH_SINE * M_PI_2);
+        if (++w == MASK_WORDS)
+            return -1;
+        bits = m->w[w];
     }
+    return w * 64 + __builtin_ctzll(bits);
 }
 
-float sine(const float x_rad)
+// the lowest slot that isn't in 'm', -1 if they all are
+static inline int freeSlot(const SlotMask *const m)
 {
-    const long x = ((long) ((x_rad >= 0 ? x_rad : -x_rad + M_PI) / M_PI * 2 * (1<<16))) & ((1<<18) - 1); 
-    if (x < (1<<16))
+    for (int w = 0; w < MASK_WORDS; ++w)
     {
-        // printf("a %d %f\n", x, sin_arr[x]);
-        return sin_arr[x];
+        if (~m->w[w] == 0)
+            continue;
+        const int i = w * 64 + __builtin_ctzll(~m->w[w]);
+        return i < NUM_CYCLES ? i : -1;
     }
-    else if (x < (1<<16)*2-1)
+    return -1;
+}
+
+static inline uint32_t idHome(const uint32_t id)
+{
+    return id * 2654435761u % ID_SLOTS;
+}
+
+// the entry for instruction 'id', NULL if the cycle table doesn't know it
+IdEntry *findId(const uint32_t id)
+{
+    for (uint32_t h = idHome(id); ids.e[h].used; h = (h + 1) % ID_SLOTS)
+        if (ids.e[h].id == id)
+            return &ids.e[h];
+    return NULL;
+}
+
+// the entry for instruction 'id', added empty if there isn't one yet
+IdEntry *addId(const uint32_t id)
+{
+    uint32_t h = idHome(id);
+    for (; ids.e[h].used; h = (h + 1) % ID_SLOTS)
+        if (ids.e[h].id == id)
+            return &ids.e[h];
+    ids.e[h] = (IdEntry){.id = id, .slot = -1, .writers = -1, .used = true};
+    return &ids.e[h];
+}
+
+// remove 'entry' once nothing refers to it. the entries probed past it move back into the hole,
+// so entry pointers don't survive this.
+void dropId(IdEntry *const entry)
+{
+    if (entry->slot >= 0 || entry->writers >= 0)
+        return;
+    uint32_t hole = entry - ids.e;
+    for (uint32_t h = (hole + 1) % ID_SLOTS; ids.e[h].used; h = (h + 1) % ID_SLOTS)
     {
-        // printf("b %d %f %d\n", x, sin_arr[2 * HIGH_SINE - x], 2 * HIGH_SINE - x);
-        return sin_arr[2 * HIGH_SINE - x];
+        // it can move unless its home is after the hole
+        if ((h - idHome(ids.e[h].id) + ID_SLOTS) % ID_SLOTS >= (h - hole + ID_SLOTS) % ID_SLOTS)
+        {
+            ids.e[hole] = ids.e[h];
+            hole = h;
+        }
     }
-    else if (x < (1<<16)*3-1)
+    ids.e[hole].used = false;
+}
+
+// empty the cycle table
+void clearCycles()
+{
+    memset(cycles, 0, sizeof(cycles));
+    memset(&live, 0, sizeof(live));
+    memset(&attr_live, 0, sizeof(attr_live));
+    memset(&ids, 0, sizeof(ids));
+    newest = -1;
+}
+
+// sin() / cos() polynomials on [-pi/4, pi/4] (cephes), with the argument
+// folded into octants so the whole thing is branch free and vectorizes.
+#define FOPI 1.27323954473516f
+#define DP1 0.78515625f
+#define DP2 2.4187564849853515625e-4f
+#define DP3 3.77489497744594108e-8f
+#define SIN_P0 -1.9515295891e-4f
+#define SIN_P1 8.3321608736e-3f
+#define SIN_P2 -1.6666654611e-1f
+#define COS_P0 2.443315711809948e-5f
+#define COS_P1 -1.388731625493765e-3f
+#define COS_P2 4.166664568298827e-2f
+
+// quadrant is 0 for sine and 2 for cosine (cos(x) = sin(x + pi/2))
+static inline float waveSample(const float x, const int quadrant)
+{
+    const float ax = fabsf(x);
+    int j = (int)(ax * FOPI);
+    j = (j + 1) & ~1;
+    const float y = (float)j;
+    const float r = ((ax - y * DP1) - y * DP2) - y * DP3;
+    const float z = r * r;
+    const float ps = ((SIN_P0 * z + SIN_P1) * z + SIN_P2) * z * r + r;
+    const float pc = ((COS_P0 * z + COS_P1) * z + COS_P2) * z * z - 0.5f * z + 1.0f;
+
+    j += quadrant;
+    float v = (j & 2) ? pc : ps;
+    if (j & 4) v = -v;
+    if (quadrant == 0 && x < 0) v = -v;
+    return v;
+}
+
+// out[i] = sin(in[i]) or cos(in[i]) for n samples.
+// works in whole vectors, so it reads and writes up to WAVE_WIDTH - 1 past n.
+void waveSpan(const float *const in, float *const out, const int n, const uint8_t wave)
+{
+    const int quadrant = wave == SINE ? 0 : 2;
+#if WAVE_WIDTH == 8
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    const __m256i quad = _mm256_set1_epi32(quadrant);
+    for (int i = 0; i < n; i += 8)
     {
-        // printf("c %d %f %d\n", x, -sin_arr[x - HIGH_SINE * 2 - 1], x - HIGH_SINE * 2 - 1);
-        return -sin_arr[x - HIGH_SINE * 2 - 1];
+        const __m256 x = _mm256_loadu_ps(in + i);
+        const __m256 ax = _mm256_andnot_ps(sign_mask, x);
+        __m256i j = _mm256_cvttps_epi32(_mm256_mul_ps(ax, _mm256_set1_ps(FOPI)));
+        j = _mm256_and_si256(_mm256_add_epi32(j, _mm256_set1_epi32(1)), _mm256_set1_epi32(~1));
+        const __m256 y = _mm256_cvtepi32_ps(j);
+        __m256 r = _mm256_sub_ps(ax, _mm256_mul_ps(y, _mm256_set1_ps(DP1)));
+        r = _mm256_sub_ps(r, _mm256_mul_ps(y, _mm256_set1_ps(DP2)));
+        r = _mm256_sub_ps(r, _mm256_mul_ps(y, _mm256_set1_ps(DP3)));
+        const __m256 z = _mm256_mul_ps(r, r);
+
+        __m256 ps = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(SIN_P0), z), _mm256_set1_ps(SIN_P1));
+        ps = _mm256_add_ps(_mm256_mul_ps(ps, z), _mm256_set1_ps(SIN_P2));
+        ps = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(ps, z), r), r);
+
+        __m256 pc = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(COS_P0), z), _mm256_set1_ps(COS_P1));
+        pc = _mm256_add_ps(_mm256_mul_ps(pc, z), _mm256_set1_ps(COS_P2));
+        pc = _mm256_mul_ps(_mm256_mul_ps(pc, z), z);
+        pc = _mm256_add_ps(_mm256_sub_ps(pc, _mm256_mul_ps(_mm256_set1_ps(0.5f), z)), _mm256_set1_ps(1.0f));
+
+        j = _mm256_add_epi32(j, quad);
+        const __m256 use_cos = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(j, _mm256_set1_epi32(2)), _mm256_set1_epi32(2)));
+        __m256 v = _mm256_or_ps(_mm256_and_ps(use_cos, pc), _mm256_andnot_ps(use_cos, ps));
+        v = _mm256_xor_ps(v, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(j, _mm256_set1_epi32(4)), 29)));
+        if (quadrant == 0)
+            v = _mm256_xor_ps(v, _mm256_and_ps(sign_mask, x));
+        _mm256_storeu_ps(out + i, v);
     }
-    else
+#elif WAVE_WIDTH == 4
+    const __m128 sign_mask = _mm_set1_ps(-0.0f);
+    const __m128i quad = _mm_set1_epi32(quadrant);
+    for (int i = 0; i < n; i += 4)
     {
-        // printf("d %d %f %d\n", x, -sin_arr[4 * HIGH_SINE - x], 4 * HIGH_SINE - x);
-        return -sin_arr[4 * HIGH_SINE - x];
+        const __m128 x = _mm_loadu_ps(in + i);
+        const __m128 ax = _mm_andnot_ps(sign_mask, x);
+        __m128i j = _mm_cvttps_epi32(_mm_mul_ps(ax, _mm_set1_ps(FOPI)));
+        j = _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+        const __m128 y = _mm_cvtepi32_ps(j);
+        __m128 r = _mm_sub_ps(ax, _mm_mul_ps(y, _mm_set1_ps(DP1)));
+        r = _mm_sub_ps(r, _mm_mul_ps(y, _mm_set1_ps(DP2)));
+        r = _mm_sub_ps(r, _mm_mul_ps(y, _mm_set1_ps(DP3)));
+        const __m128 z = _mm_mul_ps(r, r);
+
+        __m128 ps = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(SIN_P0), z), _mm_set1_ps(SIN_P1));
+        ps = _mm_add_ps(_mm_mul_ps(ps, z), _mm_set1_ps(SIN_P2));
+        ps = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(ps, z), r), r);
+
+        __m128 pc = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(COS_P0), z), _mm_set1_ps(COS_P1));
+        pc = _mm_add_ps(_mm_mul_ps(pc, z), _mm_set1_ps(COS_P2));
+        pc = _mm_mul_ps(_mm_mul_ps(pc, z), z);
+        pc = _mm_add_ps(_mm_sub_ps(pc, _mm_mul_ps(_mm_set1_ps(0.5f), z)), _mm_set1_ps(1.0f));
+
+        j = _mm_add_epi32(j, quad);
+        const __m128 use_cos = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(j, _mm_set1_epi32(2)), _mm_set1_epi32(2)));
+        __m128 v = _mm_or_ps(_mm_and_ps(use_cos, pc), _mm_andnot_ps(use_cos, ps));
+        v = _mm_xor_ps(v, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(j, _mm_set1_epi32(4)), 29)));
+        if (quadrant == 0)
+            v = _mm_xor_ps(v, _mm_and_ps(sign_mask, x));
+        _mm_storeu_ps(out + i, v);
     }
+#else
+    for (int i = 0; i < n; ++i)
+        out[i] = waveSample(in[i], quadrant);
+#endif
 }
 
-float cosine(const float x_rad)
+uint64_t nowNanos()
 {
-    const long x = ((long) ((x_rad >= 0 ? x_rad : -x_rad) / M_PI * (float)(1<<17))) & ((1<<18) - 1) - 0; 
-    static const int num = (1<<16);
-    // printf("%8.4f ", x_rad);
-    if (x < (1<<16))
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(count.QuadPart / (double)freq.QuadPart * 1e9);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// waveSpan() for the block solver, timed into wave_ns for 'bench'
+void solveWave(const float *const in, float *const out, const int n, const uint8_t wave)
+{
+    const uint64_t start = timing_stages ? nowNanos() : 0;
+    waveSpan(in, out, n, wave);
+    if (timing_stages)
+        wave_ns += nowNanos() - start;
+}
+
+// the buffer holding the per sample values of one attribute of a cycle, or NULL if it isn't modulated.
+float *modulation(const int slot, const uint8_t target_var)
+{
+    const int m = slot * 3 + (target_var - TARGET_HIGH);
+    return mod_used[m] ? mod_buf[m] : NULL;
+}
+
+// mark an attribute as modulated this block and hand back its buffer to write into
+float *startModulation(const int slot, const uint8_t target_var, uint8_t **written)
+{
+    const int m = slot * 3 + (target_var - TARGET_HIGH);
+    if (mod_buf[m] == NULL)
     {
-        // printf("a %d %f %d\n", num - x-1, sin_arr[num - x - 1], x);
-        return sin_arr[num - x - 1];
+        mod_buf[m] = malloc(ISR_HZ * sizeof(float));
+        mod_written[m] = malloc(ISR_HZ);
+        if (mod_buf[m] == NULL || mod_written[m] == NULL)
+        {
+            fprintf(stderr, "Out of memory for modulation buffers\n");
+            exit(1);
+        }
     }
-    else if (x < (1<<16)*2)
+    if (!mod_used[m])
     {
-        // printf("b %d %f %d\n", x - num, -sin_arr[x - num], x);
-        return -sin_arr[x - num];
+        memset(mod_written[m], 0, block_len);
+        mod_used[m] = true;
     }
-    else if (x < (1<<16)*3)
+    *written = mod_written[m];
+    return mod_buf[m];
+}
+
+// all writers of an attribute are done. samples nobody wrote keep the last written value,
+// and the final value sticks to the cycle for the next block. a walk only fills in its own samples.
+float finishModulation(const int slot, const uint8_t target_var, const float value, const bool render)
+{
+    const int m = slot * 3 + (target_var - TARGET_HIGH);
+    if (!mod_used[m])
+        return value;
+
+    float *const buf = mod_buf[m];
+    const uint8_t *const written = mod_written[m];
+    if (render && memchr(written, 0, block_len) == NULL)
+        return buf[block_len - 1]; // written all the way through, nothing to fill in
+    float carry = value;
+    const uint32_t n = render ? block_len : (uint32_t)walk_count;
+    for (uint32_t s = 0; s < n; ++s)
     {
-        // printf("c %d %f %d\n", num * 3 - x, -sin_arr[num * 3 - x - 1], x);
-        return -sin_arr[num * 3 - x - 1];
+        const uint32_t k = render ? s : walk_samples[s];
+        if (written[k])
+            carry = buf[k];
+        else
+            buf[k] = carry;
     }
-    else
+    return carry;
+}
+
+// a thread is about to exit, give back its modulation buffers
+void freeModulation()
+{
+    for (int m = 0; m < NUM_CYCLES * 3; ++m)
     {
-        // printf("d %d %f %d\n", x - 3 * num, sin_arr[x - 3 * num], x);
-        return sin_arr[x - 3 * num];
+        free(mod_buf[m]);
+        free(mod_written[m]);
+        mod_buf[m] = NULL;
+        mod_written[m] = NULL;
     }
 }
 
-void rotate_point(const int k, const float angle, const float cx, const float cy)
+// the array a POS (audio included) or COLOR cycle writes into, in this thread's laser
+void *targetArray(const uint8_t target_var)
 {
-    const float sin_ = sine(angle);
-    const float cos_ = cosine(angle);
-    const float dx = (float)(laser.x_pos[k]) - cx;
-    const float dy = (float)(laser.y_pos[k]) - cy;
-    const float x_rot = cx + dx * cos_ - dy * sin_;
-    const float y_rot = cy + dx * sin_ + dy * cos_;
-
-    // Clamp 
-    laser.x_pos[k] = (uint16_t)(x_rot < 0 ? 0 : (x_rot > 4095 ? 4095 : x_rot + 0.5f));
-    laser.y_pos[k] = (uint16_t)(y_rot < 0 ? 0 : (y_rot > 4095 ? 4095 : y_rot + 0.5f));
+    switch (target_var)
+    {
+    case TARGET_X: return laser.x_pos;
+    case TARGET_Y: return laser.y_pos;
+    case TARGET_R: return laser.r;
+    case TARGET_G: return laser.g;
+    case TARGET_B: return laser.b;
+    case TARGET_AUDIO_L: return laser.audio_l;
+    case TARGET_AUDIO_R: return laser.audio_r;
+    default:       return NULL;
+    }
 }
 
-void solveCycles(const uint32_t current_time)
+// evaluate one cycle over samples [k0, k1) of the block
+void solveCycle(const int i, const int k0, const int k1)
 {
-    memset(&laser, 0, sizeof(Laser));
+    Cycle *const cy = &cycles[i];
+    const float *const high = modulation(i, TARGET_HIGH);
+    const float *const low = modulation(i, TARGET_LOW);
+    const float *const phase = modulation(i, TARGET_PHASE);
+    const int n = k1 - k0;
 
-    for (uint32_t j = current_time, k = 0; k < ISR_HZ; ++j, ++k)
+    // color is set by the cycle.low value
+    if (cy->target_type == COLOR)
     {
-        for (int8_t i = highest_index; i >= 0; --i)
-        {
-            Cycle *const cy = &cycles[i];
+        uint8_t *const color = (uint8_t*)targetArray(cy->target_var);
+        if (low == NULL)
+            memset(color + k0, (uint8_t) (cy->low + 0.5f), n);
+        else
+            for (int k = k0; k < k1; ++k)
+                color[k] = (uint8_t) (low[k] + 0.5f);
+        return;
+    }
 
-            //  cycle not alive or ready to be used.
-            if (!cy->alive || j < cy->start)
-                continue;
+    // math
+    // the accumulator wraps once per turn, so the argument always lands in [-pi, pi) before the phase
+    uint64_t acc = cy->phase_acc;
+    const uint64_t inc = cy->phase_inc;
+    if (phase == NULL)
+        for (int k = k0; k < k1; ++k, acc += inc)
+            arg_buf[k] = (float)(int32_t)(acc >> 32) * acc_convert + cy->phase;
+    else
+        for (int k = k0; k < k1; ++k, acc += inc)
+            arg_buf[k] = (float)(int32_t)(acc >> 32) * acc_convert + phase[k];
+    cy->phase_acc = acc;
+    solveWave(arg_buf + k0, wave_buf + k0, n, cy->wave);
 
-            // cycle should be shut down
-            if (j >= cy->end)
-            {
-                cy->alive = false;
+    // wave_buf becomes wave * amp + mid
+    if (high == NULL && low == NULL)
+    {
+        const float mid = (cy->high + cy->low) / 2.0f;
+        const float amp = (cy->high - cy->low) / 2.0f;
+        for (int k = k0; k < k1; ++k)
+            wave_buf[k] = wave_buf[k] * amp + mid;
+    }
+    else
+    {
+        for (int k = k0; k < k1; ++k)
+        {
+            const float h = high ? high[k] : cy->high;
+            const float l = low ? low[k] : cy->low;
+            wave_buf[k] = wave_buf[k] * ((h - l) / 2.0f) + (h + l) / 2.0f;
+        }
+    }
 
-                // look for the next largest index that is alive and set the 'highest_index' to that
-                for (int8_t p = i - 1; p >= 0 && i == highest_index; --p)
-                {
-                    if (cycles[p].alive)
-                    {
-                        highest_index = p;
-                        break;
-                    }
-                }
-                continue;   
-            }
+    // set the target variable depending on its datatype
+    switch (cy->target_type)
+    {
+    case ATTR:
+    {
+        uint8_t *written;
+        float *const buf = startModulation(cy->target_slot, cy->target_var, &written);
+        memcpy(buf + k0, wave_buf + k0, n * sizeof(float));
+        memset(written + k0, 1, n);
+        break;
+    }
+
+    case POS:
+    {
+        uint16_t *const pos = (uint16_t*)targetArray(cy->target_var);
+        for (int k = k0; k < k1; ++k)
+            pos[k] = (uint16_t)(int32_t) (wave_buf[k] + 0.5f) + pos[k];
+        break;
+    }
 
-            // color is set by the cycle.low value
-            if (cy->target_type == COLOR)
+    case ROTATE:
+    {
+        for (int k = k0; k < k1; ++k)
+            wave_buf[k] += 0.5f;
+        solveWave(wave_buf + k0, arg_buf + k0, n, SINE);
+        solveWave(wave_buf + k0, trig_buf + k0, n, COSINE);
+        const uint64_t start = timing_stages ? nowNanos() : 0;
+        if (!rotated)
+        {
+            for (uint32_t k = 0; k < block_len; ++k)
             {
-                ((uint8_t*)cy->target)[k]= (uint8_t) (cy->low + 0.5f);
-                continue;
+                rot_cos[k] = 1;
+                rot_sin[k] = rot_dx[k] = rot_dy[k] = 0;
             }
+            rotated = true;
+        }
 
-            // math
-            // printf("%d %d %f %f ", j, i, x_convert, cy->hz);
-            const float x = (float)(j - cy->start) * x_convert * cy->hz + cy->phase;
-            const float mid = (cy->high + cy->low) / 2.0f;
-            const float amp = (cy->high - cy->low) / 2.0f;
-            
-            // set the target variable depending on its datatype
-            switch (cy->target_type)
-            {
-            case ATTR:
-                *(float*)cy->target = cy->wave(x) * amp + mid;
-                break;
+        // this rotation about the center, after whatever is already in the transform
+        const float cx = cy->center_x, cy_ = cy->center_y;
+        for (int k = k0; k < k1; ++k)
+        {
+            const float sin_ = arg_buf[k];
+            const float cos_ = trig_buf[k];
+            const float c = rot_cos[k], s = rot_sin[k], dx = rot_dx[k] - cx, dy = rot_dy[k] - cy_;
+            rot_cos[k] = cos_ * c - sin_ * s;
+            rot_sin[k] = sin_ * c + cos_ * s;
+            rot_dx[k] = cx + dx * cos_ - dy * sin_;
+            rot_dy[k] = cy_ + dx * sin_ + dy * cos_;
+        }
+        if (timing_stages)
+            rotate_ns += nowNanos() - start;
+        break;
+    }
+    
+    default:
+    }
+}
 
-            case POS:
-                ((uint16_t*)cy->target)[k] = (uint16_t) (cy->wave(x) * amp + mid + 0.5f) + ((uint16_t*)cy->target)[k];
-                break;
+// solveCycle() for a bound ATTR cycle when nothing is drawn, where all that matters is the values
+// it leaves behind. whatever an attribute carries into the next block was written at the last sample
+// some ATTR cycle wrote, and what a writer sees of its own modulation at one of those samples was
+// written at one of them too. so working out every ATTR cycle at just the last sample of each
+// ATTR cycle in the block gives the same values as solving all of them sample by sample.
+void walkCycle(const int i, const uint32_t k0, const uint32_t k1)
+{
+    Cycle *const cy = &cycles[i];
+    const float *const high = modulation(i, TARGET_HIGH);
+    const float *const low = modulation(i, TARGET_LOW);
+    const float *const phase = modulation(i, TARGET_PHASE);
 
-            case ROTATE:
-                rotate_point(k, (cy->wave(x) * amp + mid + 0.5f), cy->center_x, cy->center_y);
-                break;
-            
-            default:
-            }
+    int first = 0, n = 0;
+    while (first < walk_count && walk_samples[first] < k0)
+        ++first;
+    for (; first + n < walk_count && walk_samples[first + n] < k1; ++n)
+    {
+        const uint32_t k = walk_samples[first + n];
+        const uint64_t acc = cy->phase_acc + cy->phase_inc * (k - k0);
+        arg_buf[n] = (float)(int32_t)(acc >> 32) * acc_convert + (phase == NULL ? cy->phase : phase[k]);
+    }
+    cy->phase_acc += cy->phase_inc * (k1 - k0);
+    if (n == 0)
+        return;
+    waveSpan(arg_buf, wave_buf, n, cy->wave);
+
+    // the same arithmetic as solveCycle(), so the values come out bit for bit the same
+    uint8_t *written;
+    float *const buf = startModulation(cy->target_slot, cy->target_var, &written);
+    const float mid = (cy->high + cy->low) / 2.0f;
+    const float amp = (cy->high - cy->low) / 2.0f;
+    for (int s = 0; s < n; ++s)
+    {
+        const uint32_t k = walk_samples[first + s];
+        if (high == NULL && low == NULL)
+            buf[k] = wave_buf[s] * amp + mid;
+        else
+        {
+            const float h = high ? high[k] : cy->high;
+            const float l = low ? low[k] : cy->low;
+            buf[k] = wave_buf[s] * ((h - l) / 2.0f) + (h + l) / 2.0f;
         }
+        written[k] = 1;
     }
 }
 
-void showPos()
+static int compareSamples(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// the last sample of each ATTR cycle alive in the block, for walkCycle()
+void findWalkSamples(const uint32_t current_time)
+{
+    const uint32_t block_end = current_time + block_len;
+    int n = 0;
+    for (int i = nextSlot(&attr_live, 0); i >= 0; i = nextSlot(&attr_live, i + 1))
+        if (cycles[i].start < block_end && cycles[i].end > current_time)
+            walk_samples[n++] = (cycles[i].end < block_end ? cycles[i].end : block_end) - 1 - current_time;
+    qsort(walk_samples, n, sizeof(uint32_t), compareSamples);
+    walk_count = 0;
+    for (int s = 0; s < n; ++s)
+        if (walk_count == 0 || walk_samples[s] != walk_samples[walk_count - 1])
+            walk_samples[walk_count++] = walk_samples[s];
+}
+
+// the composed rotations go onto the finished positions, clamped once at the end
+void applyRotation()
 {
-    for (int i = 0; i < ISR_HZ; ++i)
+    for (uint32_t k = 0; k < block_len; ++k)
     {
-        fprintf(fp, "%d\n", laser.x_pos[i]);
-        // printf("%d\n", x_pos[i]);
-    }  
+        const float x = laser.x_pos[k], y = laser.y_pos[k];
+        const float x_rot = rot_cos[k] * x - rot_sin[k] * y + rot_dx[k];
+        const float y_rot = rot_sin[k] * x + rot_cos[k] * y + rot_dy[k];
+        laser.x_pos[k] = (uint16_t)(x_rot < 0 ? 0 : (x_rot > 4095 ? 4095 : x_rot + 0.5f));
+        laser.y_pos[k] = (uint16_t)(y_rot < 0 ? 0 : (y_rot > 4095 ? 4095 : y_rot + 0.5f));
+    }
 }
 
-void removeDeadCycles()
+// order the live cycles so every bound ATTR cycle is solved before the cycle it modulates,
+// followed by everything else. ties go to the newest cycle first, so the order
+// depends only on the show and not on which slots cycles landed in.
+int orderCycles(uint16_t *const order)
 {
-    for (int i = 0; i < NUM_CYCLES; ++i)
+    uint16_t writers[NUM_CYCLES] = {0}; // unsolved ATTR cycles aimed at each slot
+    SlotMask pending = {0};
+    int pending_count = 0;
+    for (int i = nextSlot(&attr_live, 0); i >= 0; i = nextSlot(&attr_live, i + 1))
+    {
+        if (cycles[i].target_slot < 0)
+            continue;
+        addSlot(&pending, i);
+        ++pending_count;
+        if (cycles[i].target_slot != i)
+            ++writers[cycles[i].target_slot];
+    }
+
+    int n = 0;
+    for (; pending_count > 0; --pending_count)
     {
-        // if cycle not alive, then replace it with the next one in the list
-        if (!cycles[i].alive)
+        // wait while another pending ATTR cycle still writes to this one
+        int pick = -1, fallback = -1;
+        for (int i = newest; i >= 0 && pick < 0; i = cycles[i].older)
         {
-            // iterate through the remaining cycles
-            for (int j = i + 1; j < NUM_CYCLES; ++j)
-            {
-                // if cycle alive then copy it over to the non-alive one, and kill the old cycle so it doesn't get used.
-                if (cycles[j].alive)
-                {
-                    memcpy(&cycles[i], &cycles[j], sizeof(Cycle));
-                    cycles[j].alive = false;
-                }
-            }
+            if (!hasSlot(&pending, i))
+                continue;
+            if (fallback < 0)
+                fallback = i;
+            if (writers[i] == 0)
+                pick = i;
         }
+        if (pick < 0)
+            pick = fallback; // modulation loop, just break it somewhere
+        pending.w[pick >> 6] &= ~(1ULL << (pick & 63));
+        if (cycles[pick].target_slot != pick)
+            --writers[cycles[pick].target_slot];
+        order[n++] = pick;
     }
+
+    // unbound ATTR cycles go along too, they only move their phase on
+    for (int i = newest; i >= 0; i = cycles[i].older)
+        if (!hasSlot(&attr_live, i) || cycles[i].target_slot < 0)
+            order[n++] = i;
+    return n;
 }
 
-bool setCycle(const Cycle *const cycle, bool firstCall)
+// free the slots in 'mask' and unbind any ATTR cycle that pointed at them
+void releaseCycles(const SlotMask *const mask)
 {
-    for (int i = 0; i < NUM_CYCLES; ++i)
+    for (int i = nextSlot(mask, 0); i >= 0; i = nextSlot(mask, i + 1))
     {
-        // if the target address is at or below the current cycle, then continue up the array
-        if ((void*)cycle->target > (void*)&cycles[i + 1] 
-            && cycle->target_type != POS
-            && cycle->target_type != ROTATE) 
-            continue;
-        if (cycles[i].alive) continue;
-        if (i > highest_index) highest_index = i;
+        Cycle *const cy = &cycles[i];
+        if (cy->newer >= 0)
+            cycles[cy->newer].older = cy->older;
+        else
+            newest = cy->older;
+        if (cy->older >= 0)
+            cycles[cy->older].newer = cy->newer;
+
+        IdEntry *const self = findId(cy->id);
+        self->slot = -1;
+        for (int a = self->writers; a >= 0; a = cycles[a].next_writer)
+            cycles[a].target_slot = -1;
+        dropId(self);
+        if (cy->target_type == ATTR)
+        {
+            if (cy->next_writer >= 0)
+                cycles[cy->next_writer].prev_writer = cy->prev_writer;
+            IdEntry *const target = findId(cy->target_id);
+            if (cy->prev_writer >= 0)
+                cycles[cy->prev_writer].next_writer = cy->next_writer;
+            else
+                target->writers = cy->next_writer;
+            dropId(target);
+        }
+    }
+    for (int w = 0; w < MASK_WORDS; ++w)
+    {
+        live.w[w] &= ~mask->w[w];
+        attr_live.w[w] &= ~mask->w[w];
+    }
+}
+
+// free the live cycles that ran out by 'time'
+void releaseExpired(const uint32_t time)
+{
+    SlotMask expired = {0};
+    bool any = false;
+    for (int i = nextSlot(&live, 0); i >= 0; i = nextSlot(&live, i + 1))
+    {
+        if (cycles[i].end <= time)
+        {
+            addSlot(&expired, i);
+            any = true;
+        }
+    }
+    if (any)
+        releaseCycles(&expired);
+}
+
+// solve one block, one cycle at a time over the samples where it is alive.
+// without 'render' only the cycle table moves on (ATTR cycles and phases) and nothing is drawn.
+void solveCycles(const uint32_t current_time, const bool render)
+{
+    uint16_t order[NUM_CYCLES];
+    const uint32_t block_end = current_time + block_len;
+
+    // cycles that ran out before this block are shut down
+    releaseExpired(current_time);
+
+    if (render)
+    {
+        memset(laser.x_pos, 0, block_len * sizeof(uint16_t));
+        memset(laser.y_pos, 0, block_len * sizeof(uint16_t));
+        memset(laser.r, 0, block_len);
+        memset(laser.g, 0, block_len);
+        memset(laser.b, 0, block_len);
+        memset(laser.audio_l, 0, block_len * sizeof(uint16_t));
+        memset(laser.audio_r, 0, block_len * sizeof(uint16_t));
+    }
+    memset(mod_used, 0, sizeof(mod_used));
+    rotated = false;
+    if (!render)
+        findWalkSamples(current_time);
+    const int n = orderCycles(order);
 
+    for (int o = 0; o < n; ++o)
+    {
+        const int i = order[o];
         Cycle *const cy = &cycles[i];
 
-        cy->alive = true;
-        cy->start = cycle->start;
-        cy->end = cycle->end;
-        cy->low = cycle->low;
-        cy->high = cycle->high;
-        cy->phase = cycle->phase;
-        cy->hz = cycle->hz;
-        cy->target = cycle->target;
-        cy->target_type = cycle->target_type;
-        cy->wave = cycle->wave;
-        return false;
+        cy->high = finishModulation(i, TARGET_HIGH, cy->high, render);
+        cy->low = finishModulation(i, TARGET_LOW, cy->low, render);
+        cy->phase = finishModulation(i, TARGET_PHASE, cy->phase, render);
+
+        // the part of the block where the cycle is alive
+        uint32_t from = cy->start > current_time ? cy->start : current_time;
+        const uint32_t to = cy->end < block_end ? cy->end : block_end;
+        if (from >= to)
+            continue;
+
+        // an ATTR cycle only writes while its target is running, before that (or with no target
+        // loaded at all) it just keeps time. that way the output doesn't depend on the block size.
+        if (cy->target_type == ATTR && cy->target_slot >= 0 && from < cycles[cy->target_slot].start)
+        {
+            const uint32_t idle_to = cycles[cy->target_slot].start < to ? cycles[cy->target_slot].start : to;
+            cy->phase_acc += cy->phase_inc * (idle_to - from);
+            from = idle_to;
+            if (from >= to)
+                continue;
+        }
+        const bool writes = cy->target_type == ATTR ? cy->target_slot >= 0 : render;
+        if (writes && render)
+            solveCycle(i, from - current_time, to - current_time);
+        else if (writes)
+            walkCycle(i, from - current_time, to - current_time);
+        else if (cy->target_type != COLOR)
+            cy->phase_acc += cy->phase_inc * (to - from);
     }
 
-    if (firstCall)
+    if (render && rotated)
     {
-        removeDeadCycles();
-        return setCycle(cycle, false); 
+        const uint64_t start = timing_stages ? nowNanos() : 0;
+        applyRotation();
+        if (timing_stages)
+            rotate_ns += nowNanos() - start;
     }
-    return true;
 }
 
-void setTargetVariable(Cycle *const cycle, const char *const val)
+// load a cycle into the lowest free slot. true if the table is full.
+bool setCycle(const Cycle *const cycle, const uint32_t now)
+{
+    // cycles that have run out are only shut down by the next solveCycles(), so make room early if needed
+    int i = freeSlot(&live);
+    if (i < 0)
+    {
+        releaseExpired(now);
+        i = freeSlot(&live);
+    }
+    if (i < 0)
+        return true;
+
+    Cycle *const cy = &cycles[i];
+    *cy = *cycle;
+    addSlot(&live, i);
+    cy->older = newest;
+    cy->newer = -1;
+    if (newest >= 0)
+        cycles[newest].newer = i;
+    newest = i;
+
+    // ATTR cycles find their target by instruction id, which ever of the two is loaded first
+    IdEntry *const self = addId(cy->id);
+    self->slot = i;
+    for (int a = self->writers; a >= 0; a = cycles[a].next_writer)
+        cycles[a].target_slot = i;
+    if (cy->target_type == ATTR)
+    {
+        addSlot(&attr_live, i);
+        IdEntry *const target = addId(cy->target_id);
+        cy->target_slot = target->slot;
+        cy->prev_writer = -1;
+        cy->next_writer = target->writers;
+        if (target->writers >= 0)
+            cycles[target->writers].prev_writer = i;
+        target->writers = i;
+    }
+    return false;
+}
+
+void setTargetVariable(CompiledCycle *const cycle, const char *const val)
 {
     switch (val[0])
     {
     case 'x':
-        cycle->target = (void*)laser.x_pos;
-        cycle->target_type = POS;
+        cycle->target = TARGET_X;
         break;
     case 'y':
-        cycle->target = (void*)laser.y_pos;
-        cycle->target_type = POS;
+        cycle->target = TARGET_Y;
         break;
     case 'r':
-        cycle->target = (void*)laser.r;
-        cycle->target_type = COLOR;
+        cycle->target = TARGET_R;
         break;
     case 'g':
-        cycle->target = (void*)laser.g;
-        cycle->target_type = COLOR;
+        cycle->target = TARGET_G;
         break;
     case 'b':
-        cycle->target = (void*)laser.b;
-        cycle->target_type = COLOR;
+        cycle->target = TARGET_B;
         break;
     case 'o':
-        cycle->target = NULL;
-        cycle->target_type = ROTATE;
+        cycle->target = TARGET_ROTATE;
+        break;
+    case 'a':
+        cycle->target = val[1] == 'r' ? TARGET_AUDIO_R : TARGET_AUDIO_L;
         break;
         
     default:
@@ -313,29 +1041,89 @@ void setTargetVariable(Cycle *const cycle, const char *const val)
                 char_index = 4;
             }
         }
-        int cycle_index = atoi(num);
+        cycle->target_index = atoi(num);
         switch (val[char_index])
         {
         case 'h':
-            cycle->target = &cycles[cycle_index].high;
-            cycle->target_type = ATTR;
+            cycle->target = TARGET_HIGH;
             break;
         case 'l':
-            cycle->target = &cycles[cycle_index].low;
-            cycle->target_type = ATTR;
+            cycle->target = TARGET_LOW;
             break;
         case 'p':
-            cycle->target = &cycles[cycle_index].phase;
-            cycle->target_type = ATTR;
+            cycle->target = TARGET_PHASE;
             break;
         }
         break;
     }
 }
 
-void setupOneVariable(int *argc, int *valc, char *val, int *max_time, char info)
+void addInstruction(const CompiledCycle *const cycle)
+{
+    static uint32_t capacity = 0;
+    if (num_instructions == capacity)
+    {
+        capacity = capacity ? capacity * 2 : 256;
+        parsed_instructions = realloc(parsed_instructions, capacity * sizeof(CompiledCycle));
+        if (parsed_instructions == NULL)
+        {
+            fprintf(stderr, "Out of memory reading instructions\n");
+            exit(1);
+        }
+    }
+    parsed_instructions[num_instructions++] = *cycle;
+}
+
+int compareStart(const void *a, const void *b)
+{
+    const uint32_t *const x = a, *const y = b;
+    const uint32_t start_a = parsed_instructions[*x].start, start_b = parsed_instructions[*y].start;
+    if (start_a != start_b)
+        return start_a < start_b ? -1 : 1;
+    return *x < *y ? -1 : (*x > *y);
+}
+
+// sort the instructions by start time so they can be streamed in,
+// and renumber the ATTR targets to match.
+void sortInstructions()
+{
+    uint32_t *const order = malloc(num_instructions * sizeof(uint32_t));
+    uint32_t *const new_index = malloc(num_instructions * sizeof(uint32_t));
+    CompiledCycle *const sorted = malloc(num_instructions * sizeof(CompiledCycle));
+    if (num_instructions && (order == NULL || new_index == NULL || sorted == NULL))
+    {
+        fprintf(stderr, "Out of memory sorting instructions\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < num_instructions; ++i)
+        order[i] = i;
+    qsort(order, num_instructions, sizeof(uint32_t), compareStart);
+
+    for (uint32_t i = 0; i < num_instructions; ++i)
+        new_index[order[i]] = i;
+
+    for (uint32_t i = 0; i < num_instructions; ++i)
+    {
+        sorted[i] = parsed_instructions[order[i]];
+        if (sorted[i].target >= TARGET_HIGH && sorted[i].target_index < num_instructions)
+            sorted[i].target_index = new_index[sorted[i].target_index];
+    }
+
+    free(parsed_instructions);
+    free(order);
+    free(new_index);
+    parsed_instructions = sorted;
+}
+
+void setupOneVariable(int *argc, int *valc, char *val, uint32_t *max_time, char info)
 {
-    static Cycle cycle;
+    static CompiledCycle cycle;
+
+    // blank line
+    if (*argc == 0 && *valc == 0 && info == '\n')
+        return;
+
     switch (*argc)
     {
     case 0:
@@ -368,7 +1156,7 @@ void setupOneVariable(int *argc, int *valc, char *val, int *max_time, char info)
         break;
     
     case 7:
-        cycle.wave = (val[0] == 's' ? sine : cosine);
+        cycle.wave = (val[0] == 's' ? SINE : COSINE);
         break;
     
     case 8:
@@ -380,43 +1168,35 @@ void setupOneVariable(int *argc, int *valc, char *val, int *max_time, char info)
         break;
     
     default:
-        printf("%s:%d Invalid value: %s in switch case: %d\n"__FILE__, __LINE__, val, argc);
+        printf("%s:%d Invalid value: %s in switch case: %d\n", __FILE__, __LINE__, val, *argc);
         exit(1);
         break;
     }
     *argc = *argc + 1;
     *valc = 0;
-    memset(val, 0, sizeof(val));    
+    memset(val, 0, 16);    
 
     if (info == '\n')
     {
-        setCycle(&cycle, true);
+        addInstruction(&cycle);
+        memset(&cycle, 0, sizeof(CompiledCycle));
         *valc = 0;
         *argc = 0;
     } 
 }
 
-void getRawInstructions()
-{
-    FILE *f = fopen(INSTRUCTIONS_FILE, "r");
-    fseek(f, 0, SEEK_END);
-    instructions_len = ftell(f);
-    rewind(f);
-    fread(instruction_file, 1, instructions_len, f);
-    fclose(f);
-}
-
-void readInstructions(int *max_time, const int current_time)
+void readInstructions(const char *const text, const size_t len, uint32_t *max_time)
 {
     char val[16] = {0};
     int valc = 0, argc = 0;
     *max_time = 0;
-    for (int i = 0; i < instructions_len; ++i)
+    num_instructions = 0;
+    for (size_t i = 0; i < len; ++i)
     {
-        switch (instruction_file[i])
+        switch (text[i])
         {
         case '#':
-            for (;i < instructions_len && instruction_file[i] != '\n'; ++i);
+            for (;i < len && text[i] != '\n'; ++i);
             break;
         
         case '\0':
@@ -424,38 +1204,1202 @@ void readInstructions(int *max_time, const int current_time)
             break;
         
         case ' ':
+        case '\r':
             break;
         
         case '\n':
-            setupOneVariable(&argc, &valc, val, max_time, instruction_file[i]);
+            setupOneVariable(&argc, &valc, val, max_time, text[i]);
             break;
         case ',':
-            setupOneVariable(&argc, &valc, val, max_time, instruction_file[i]);
+            setupOneVariable(&argc, &valc, val, max_time, text[i]);
             break;
 
         default:
-            val[valc++] = instruction_file[i];
+            // leave room for the terminator, atoi() / atof() read val as a string
+            if (valc >= (int)sizeof(val) - 1)
+            {
+                printf("%s:%d Invalid value: %s... is longer than %d characters\n", __FILE__, __LINE__, val, (int)sizeof(val) - 1);
+                exit(1);
+            }
+            val[valc++] = text[i];
             break;
         }
     }
 
     EXIT_FOR:
+    // the last line may not end with a newline
+    if (argc > 0)
+        setupOneVariable(&argc, &valc, val, max_time, '\n');
+    sortInstructions();
+    instructions = parsed_instructions;
 }
 
-int main()
+bool mapFile(const char *const path, MappedFile *const mf)
 {
-    int max_time;
-    getRawInstructions();
-    readInstructions(&max_time, 0);
-    fp = fopen("t.txt", "w");
-    fillSineArr();
+    memset(mf, 0, sizeof(MappedFile));
+#ifdef _WIN32
+    mf->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (mf->file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(mf->file, &size);
+    mf->len = (size_t)size.QuadPart;
+    if (mf->len == 0)
+        return true;
 
-    for (int i = 0; i < max_time; i += ISR_HZ)
+    mf->mapping = CreateFileMappingA(mf->file, 0, PAGE_READONLY, 0, 0, 0);
+    if (mf->mapping == NULL)
     {
-        solveCycles(i);
-        showPos();
+        CloseHandle(mf->file);
+        return false;
+    }
+    mf->data = MapViewOfFile(mf->mapping, FILE_MAP_READ, 0, 0, 0);
+    return mf->data != NULL;
+#else
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    fstat(fd, &st);
+    mf->len = (size_t)st.st_size;
+    if (mf->len == 0)
+    {
+        close(fd);
+        return true;
+    }
+
+    void *const data = mmap(NULL, mf->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    mf->data = data;
+    return true;
+#endif
+}
+
+void unmapFile(MappedFile *const mf)
+{
+#ifdef _WIN32
+    if (mf->data) UnmapViewOfFile(mf->data);
+    if (mf->mapping) CloseHandle(mf->mapping);
+    if (mf->file) CloseHandle(mf->file);
+#else
+    if (mf->data) munmap((void*)mf->data, mf->len);
+#endif
+    memset(mf, 0, sizeof(MappedFile));
+}
+
+// loads either a compiled show (mapped as is) or a text instructions file (parsed).
+void loadShow(const char *const path, uint32_t *max_time)
+{
+    if (!mapFile(path, &show_file))
+    {
+        fprintf(stderr, "Error opening %s\n", path);
+        exit(1);
+    }
+
+    const ShowHeader *const header = (const ShowHeader*)show_file.data;
+    if (show_file.len < sizeof(ShowHeader) || memcmp(header->magic, SHOW_MAGIC, 4) != 0)
+    {
+        readInstructions((const char*)show_file.data, show_file.len, max_time);
+        return;
+    }
+
+    if (header->version != SHOW_VERSION)
+    {
+        fprintf(stderr, "%s is show version %u, expected %u. Recompile it.\n", path, header->version, SHOW_VERSION);
+        exit(1);
+    }
+    if (show_file.len < sizeof(ShowHeader) + (size_t)header->count * sizeof(CompiledCycle))
+    {
+        fprintf(stderr, "%s is truncated\n", path);
+        exit(1);
+    }
+    instructions = (const CompiledCycle*)(show_file.data + sizeof(ShowHeader));
+    num_instructions = header->count;
+    *max_time = header->max_time;
+}
+
+void compileInstructions(const char *const in_path, const char *const out_path)
+{
+    uint32_t max_time;
+    loadShow(in_path, &max_time);
+
+    FILE *const f = fopen(out_path, "wb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Error opening %s\n", out_path);
+        exit(1);
+    }
+
+    ShowHeader header = {.version = SHOW_VERSION, .count = num_instructions, .max_time = max_time};
+    memcpy(header.magic, SHOW_MAGIC, 4);
+    fwrite(&header, sizeof(ShowHeader), 1, f);
+    fwrite(instructions, sizeof(CompiledCycle), num_instructions, f);
+    fclose(f);
+    printf("compiled %u instructions into %s\n", num_instructions, out_path);
+}
+
+// how far an oscillator at 'hz' turns in one sample, 1 << 64 being a full turn
+uint64_t phaseIncrement(const float hz)
+{
+    double turns = (double)hz * x_convert / (M_PI * 2.0);
+    turns -= floor(turns);
+    const double inc = turns * 18446744073709551616.0;
+    return inc >= 18446744073709551616.0 ? 0 : (uint64_t)inc;
+}
+
+// turn a symbolic instruction into a cycle that points into the live state
+void resolveCycle(const CompiledCycle *const in, const uint32_t id, Cycle *const cy)
+{
+    cy->id = id;
+    cy->target_id = in->target_index;
+    cy->target_var = in->target;
+    cy->start = in->start;
+    cy->end = in->end;
+    cy->low = in->low;
+    cy->high = in->high;
+    cy->phase = in->phase;
+    cy->hz = in->hz;
+    cy->phase_acc = 0;
+    cy->phase_inc = phaseIncrement(in->hz);
+    cy->center_x = in->center_x;
+    cy->center_y = in->center_y;
+    cy->wave = in->wave;
+    cy->target_slot = -1;
+
+    switch (in->target)
+    {
+    case TARGET_X:
+        cy->target_type = POS;
+        break;
+    case TARGET_Y:
+        cy->target_type = POS;
+        break;
+    case TARGET_R:
+        cy->target_type = COLOR;
+        break;
+    case TARGET_G:
+        cy->target_type = COLOR;
+        break;
+    case TARGET_B:
+        cy->target_type = COLOR;
+        break;
+    case TARGET_ROTATE:
+        cy->target_type = ROTATE;
+        break;
+    case TARGET_AUDIO_L:
+    case TARGET_AUDIO_R:
+        cy->target_type = POS; // summed like x and y, into the audio channels
+        break;
+    case TARGET_HIGH:
+    case TARGET_LOW:
+    case TARGET_PHASE:
+        cy->target_type = ATTR; // bound to a slot in setCycle()
+        break;
+    }
+}
+
+// load instruction 'index' into the cycle table at 'now'
+void admitInstruction(const uint32_t index, const uint32_t now)
+{
+    const CompiledCycle *const in = &instructions[index];
+    Cycle cycle;
+    resolveCycle(in, index, &cycle);
+
+    // already running, so pick up the phase where it would be by now
+    if (in->start < now)
+        cycle.phase_acc = (uint64_t)(now - in->start) * cycle.phase_inc;
+    if (setCycle(&cycle, now) && !replaying)
+    {
+        if (dropped_instructions++ == 0)
+            fprintf(stderr, "Cycle table full at %u, dropping instructions\n", now);
+    }
+}
+
+// load every instruction that starts before 'until'.
+// instructions are sorted by start so this only ever looks at the next few.
+void admitInstructions(uint32_t *const next, const uint32_t now, const uint32_t until)
+{
+    for (; *next < num_instructions && instructions[*next].start < until; ++*next)
+    {
+        // too old to keep around
+        if (instructions[*next].end <= now)
+            continue;
+
+        admitInstruction(*next, now);
+    }
+}
+
+// the first instruction that starts at or after 'time'
+uint32_t firstStartingAt(const uint32_t time)
+{
+    uint32_t lo = 0, hi = num_instructions;
+    while (lo < hi)
+    {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (instructions[mid].start < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void buildSeekIndex()
+{
+    uint32_t max_end = 0;
+    for (uint32_t i = 0; i < num_instructions; ++i)
+        max_end = instructions[i].end > max_end ? instructions[i].end : max_end;
+    seek_index.checkpoints = max_end / SEEK_STRIDE + 1;
+    seek_index.first = calloc(seek_index.checkpoints + 1, sizeof(uint32_t));
+    seek_index.writer_start = malloc((num_instructions + 1) * sizeof(uint32_t));
+    if (seek_index.first == NULL || seek_index.writer_start == NULL)
+    {
+        fprintf(stderr, "Out of memory for the seek index\n");
+        exit(1);
+    }
+
+    // count each checkpoint's instructions, then fill the lists in show order
+    for (uint32_t i = 0; i < num_instructions; ++i)
+    {
+        const CompiledCycle *const in = &instructions[i];
+        for (uint32_t c = (in->start + SEEK_STRIDE - 1) / SEEK_STRIDE; (uint64_t)c * SEEK_STRIDE < in->end; ++c)
+            ++seek_index.first[c + 1];
+    }
+    for (uint32_t c = 0; c < seek_index.checkpoints; ++c)
+        seek_index.first[c + 1] += seek_index.first[c];
+    seek_index.live = malloc((seek_index.first[seek_index.checkpoints] + 1) * sizeof(uint32_t));
+    uint32_t *const fill = malloc(seek_index.checkpoints * sizeof(uint32_t));
+    if (seek_index.live == NULL || fill == NULL)
+    {
+        fprintf(stderr, "Out of memory for the seek index\n");
+        exit(1);
+    }
+    memcpy(fill, seek_index.first, seek_index.checkpoints * sizeof(uint32_t));
+    for (uint32_t i = 0; i < num_instructions; ++i)
+    {
+        const CompiledCycle *const in = &instructions[i];
+        for (uint32_t c = (in->start + SEEK_STRIDE - 1) / SEEK_STRIDE; (uint64_t)c * SEEK_STRIDE < in->end; ++c)
+            seek_index.live[fill[c]++] = i;
+    }
+    free(fill);
+
+    for (uint32_t i = 0; i < num_instructions; ++i)
+        seek_index.writer_start[i] = UINT32_MAX;
+    for (uint32_t i = 0; i < num_instructions; ++i)
+    {
+        const CompiledCycle *const in = &instructions[i];
+        if ((in->target == TARGET_HIGH || in->target == TARGET_LOW || in->target == TARGET_PHASE) &&
+            in->target_index < num_instructions && in->start < seek_index.writer_start[in->target_index])
+            seek_index.writer_start[in->target_index] = in->start;
+    }
+}
+
+// the instructions that started before 'time' and are still running at it, in show order.
+// the caller frees the list, 'count' is its length.
+uint32_t *runningAt(const uint32_t time, uint32_t *const count)
+{
+    const uint32_t c = time / SEEK_STRIDE < seek_index.checkpoints ? time / SEEK_STRIDE : seek_index.checkpoints - 1;
+    const uint32_t from = firstStartingAt(c * SEEK_STRIDE + 1), to = firstStartingAt(time);
+    uint32_t *const out = malloc((seek_index.first[c + 1] - seek_index.first[c] + (to > from ? to - from : 0) + 1) * sizeof(uint32_t));
+    if (out == NULL)
+    {
+        fprintf(stderr, "Out of memory for a seek\n");
+        exit(1);
+    }
+
+    // the checkpoint's list comes first in show order, everything it holds started at or before the checkpoint
+    uint32_t n = 0;
+    for (uint32_t k = seek_index.first[c]; k < seek_index.first[c + 1]; ++k)
+    {
+        const CompiledCycle *const in = &instructions[seek_index.live[k]];
+        if (in->start < time && in->end > time)
+            out[n++] = seek_index.live[k];
+    }
+    for (uint32_t i = from; i < to; ++i)
+        if (instructions[i].end > time)
+            out[n++] = i;
+    *count = n;
+    return out;
+}
+
+// set the cycle table up as it stands at 'time' and return the instruction admitInstructions() carries on from.
+// cycles running at 'time' are loaded with their phase worked out directly. the one thing that depends on
+// history is an attribute an ATTR cycle has written, which keeps its last value, so those cycles are
+// loaded from where the first write could have happened and run up to 'time' without drawing.
+uint32_t seekShow(const uint32_t time)
+{
+    // nothing has started yet, so there is nothing to look up
+    if (time == 0)
+        return 0;
+    if (seek_index.first == NULL)
+        buildSeekIndex();
+
+    // move the start of the run back until nothing already running there has been written to.
+    // whatever starts later in the run is seen from its start anyway.
+    uint32_t from = time;
+    for (bool moved = true; moved && from > 0;)
+    {
+        moved = false;
+        uint32_t count;
+        uint32_t *const running = runningAt(from, &count);
+        for (uint32_t k = 0; k < count; ++k)
+        {
+            const uint32_t index = running[k];
+            const uint32_t start = instructions[index].start;
+            const uint32_t first_write = start > seek_index.writer_start[index] ? start : seek_index.writer_start[index];
+            if (first_write < from)
+            {
+                from = first_write;
+                moved = true;
+            }
+        }
+        free(running);
+    }
+
+    clearCycles();
+
+    uint32_t count;
+    uint32_t *const running = runningAt(from, &count);
+    for (uint32_t k = 0; k < count; ++k)
+        admitInstruction(running[k], from);
+    free(running);
+
+    // run up to 'time' block by block, the last one cut short to end on it
+    uint32_t next = firstStartingAt(from);
+    const uint32_t full_block = block_len;
+    for (uint32_t t = from; t < time; t += block_len)
+    {
+        block_len = time - t < full_block ? time - t : full_block;
+        admitInstructions(&next, t, t + block_len);
+        solveCycles(t, false);
+    }
+    block_len = full_block;
+    if (time > from)
+        fprintf(stderr, "Modulation run from %.3f s to reach %.3f s\n", (double)from / ISR_HZ, (double)time / ISR_HZ);
+    return next;
+}
+
+// same wire format as pack() in serial.c
+void pack(const LaserBytes *const data_array, uint8_t *const arr, int num_bytes)
+{
+    for (int i = 0, j = 0; j < num_bytes; ++i, j += 8)
+    {
+        uint8_t *const packed = &arr[j];
+        const LaserBytes *const data = &data_array[i];
+
+        // rgb: pack to 11 bits (5+6+7 bits, rounded)
+        packed[0]  =  (data->r > 31 ? 31 : data->r) & 0b00011111;       // r 
+        packed[0] |= (data->g & 0b00000111) << 5; // g 
+
+        packed[1]  = (((data->g > 31 ? 31 : data->g) >> 3) & 0b00000011);      // g 
+        packed[1] |= ((data->b > 31 ? 31 : data->b) & 0b00011111) << 2;        // b 
+
+        // laser_x (12 bits)
+        packed[2] =   data->laser_x;
+        packed[3] = ((data->laser_x >> 8) & 0x0F);
+
+        // laser_y (12 bits)
+        packed[3] |= (data->laser_y << 4) & 0xF0;
+        packed[4]  =  data->laser_y >> 4;
+
+        // audio_l (12 bits)
+        packed[5] =   data->audio_l;
+        packed[6] = ((data->audio_l >> 8) & 0x0F);
+
+        // audio_r (12 bits)
+        packed[6] |= (data->audio_r << 4) & 0xF0;
+        packed[7]  =  data->audio_r >> 4;
+    }
+}
+
+// one sample of a solved block as it goes to the laser
+static inline void frameAt(const Laser *const block, const int k, LaserBytes *const frame)
+{
+    frame->r = block->r[k];
+    frame->g = block->g[k];
+    frame->b = block->b[k];
+    frame->laser_x = block->x_pos[k] > 4095 ? 4095 : block->x_pos[k];
+    frame->laser_y = block->y_pos[k] > 4095 ? 4095 : block->y_pos[k];
+    frame->audio_l = block->audio_l[k] > 4095 ? 4095 : block->audio_l[k];
+    frame->audio_r = block->audio_r[k] > 4095 ? 4095 : block->audio_r[k];
+}
+
+// a solved block in the serial wire format, block_len * 8 bytes
+void packBlock(const Laser *const block, uint8_t *const packed)
+{
+    static _Thread_local LaserBytes frames[ISR_HZ];
+    for (uint32_t k = 0; k < block_len; ++k)
+        frameAt(block, k, &frames[k]);
+    pack(frames, packed, block_len * 8);
+}
+
+// append a solved block to the render file, packed, in one write
+void writeBlock(const Laser *const block)
+{
+    static uint8_t packed[ISR_HZ * 8];
+    packBlock(block, packed);
+    fwrite(packed, 1, block_len * 8, fp);
+}
+
+void writeRenderHeader(const uint32_t max_time)
+{
+    RenderHeader header = {.version = RENDER_VERSION, .sample_rate = ISR_HZ};
+    memcpy(header.magic, RENDER_MAGIC, 4);
+    header.frame_count = (max_time + block_len - 1) / block_len * block_len; // whole blocks
+    fwrite(&header, sizeof(RenderHeader), 1, fp);
+}
+
+SerialPort openSerial(const char *const path)
+{
+#ifdef _WIN32
+    HANDLE hSerial = CreateFileA(path, GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0);
+    if (hSerial == INVALID_HANDLE_VALUE) 
+    {
+        fprintf(stderr, "Error opening %s\n", path);
+        exit(1);
+    }
+
+    DCB dcbSerialParams = {0};
+    dcbSerialParams.DCBlength = sizeof(dcbSerialParams);
+    GetCommState(hSerial, &dcbSerialParams);
+    dcbSerialParams.BaudRate = 1000000;
+    dcbSerialParams.ByteSize = 8;
+    dcbSerialParams.StopBits = ONESTOPBIT;
+    dcbSerialParams.Parity   = NOPARITY;
+    SetCommState(hSerial, &dcbSerialParams);
+    return hSerial;
+#else
+    const int fd = open(path, O_WRONLY | O_NOCTTY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error opening %s\n", path);
+        exit(1);
+    }
+
+    // 1 Mbaud, 8N1, raw bytes
+    struct termios tty;
+    if (tcgetattr(fd, &tty) == 0)
+    {
+        cfmakeraw(&tty);
+        cfsetospeed(&tty, B1000000);
+        cfsetispeed(&tty, B1000000);
+        tty.c_cflag &= ~(PARENB | CSTOPB);
+        tty.c_cflag |= CS8 | CLOCAL;
+        tcsetattr(fd, TCSANOW, &tty);
+    }
+    return fd;
+#endif
+}
+
+bool writeSerial(const SerialPort port, const uint8_t *data, size_t len)
+{
+#ifdef _WIN32
+    DWORD bytesWritten;
+    return WriteFile(port, data, len, &bytesWritten, NULL) && bytesWritten == len;
+#else
+    while (len > 0)
+    {
+        const ssize_t n = write(port, data, len);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+#endif
+}
+
+void closeSerial(const SerialPort port)
+{
+#ifdef _WIN32
+    CloseHandle(port);
+#else
+    close(port);
+#endif
+}
+
+uint64_t nowMicros()
+{
+    return nowNanos() / 1000;
+}
+
+void waitBriefly()
+{
+#ifdef _WIN32
+    Sleep(1);
+#else
+    usleep(200);
+#endif
+}
+
+// copy the block that was just solved into the ring, waiting for the writer when it is full
+void pushBlock()
+{
+    bool waiting = false;
+    for (uint32_t k = 0; k < block_len;)
+    {
+        const uint32_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+        const uint32_t queued = head - atomic_load_explicit(&ring.tail, memory_order_acquire);
+        const uint32_t room = queued < ring.limit ? ring.limit - queued : 0;
+        if (room == 0)
+        {
+            if (!waiting)
+                ++ring.stalls;
+            waiting = true;
+            waitBriefly();
+            continue;
+        }
+        waiting = false;
+
+        const uint32_t n = room < block_len - k ? room : block_len - k;
+        for (uint32_t f = 0; f < n; ++f, ++k)
+            frameAt(&laser, k, &ring.frames[(head + f) & (RING_LEN - 1)]);
+        atomic_store_explicit(&ring.head, head + n, memory_order_release);
+    }
+}
+
+// drains the ring through pack() to the serial port until the renderer is done
+void *serialWriter(void *arg)
+{
+    (void)arg;
+    uint8_t packed[WRITE_CHUNK * 8];
+    bool starved = false;
+
+    for (;;)
+    {
+        const uint32_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+        const uint32_t waiting = atomic_load_explicit(&ring.head, memory_order_acquire) - tail;
+        if (waiting == 0)
+        {
+            if (atomic_load_explicit(&ring.done, memory_order_acquire) && atomic_load(&ring.head) == tail)
+                break;
+            if (!starved)
+                ++ring.underruns;
+            starved = true;
+            waitBriefly();
+            continue;
+        }
+        starved = false;
+
+        // a chunk stops at the end of the ring rather than wrap
+        const uint32_t to_end = RING_LEN - (tail & (RING_LEN - 1));
+        uint32_t n = waiting < WRITE_CHUNK ? waiting : WRITE_CHUNK;
+        n = n < to_end ? n : to_end;
+        pack(&ring.frames[tail & (RING_LEN - 1)], packed, n * 8);
+        atomic_store_explicit(&ring.tail, tail + n, memory_order_release);
+
+        if (!writeSerial(serial_port, packed, n * 8))
+        {
+            fprintf(stderr, "Error writing to the serial port\n");
+            exit(1);
+        }
+        ring.frames_written += n;
+
+        // every block finished by this write
+        for (; (uint64_t)(ring.blocks_written + 1) * block_len <= ring.frames_written; ++ring.blocks_written)
+        {
+            const uint64_t latency = nowMicros() - ring.admitted_us[ring.blocks_written % STAMP_LEN];
+            ring.latency_sum_us += latency;
+            ring.latency_max_us = latency > ring.latency_max_us ? latency : ring.latency_max_us;
+        }
+    }
+    return NULL;
+}
+
+// send a render file to the laser as it is, from sample 'start' on. false if 'path' isn't a render file.
+bool replayRender(const char *const path, const char *const device, const uint32_t start)
+{
+    MappedFile render;
+    if (!mapFile(path, &render))
+    {
+        fprintf(stderr, "Error opening %s\n", path);
+        exit(1);
+    }
+    const RenderHeader *const header = (const RenderHeader*)render.data;
+    if (render.len < sizeof(RenderHeader) || memcmp(header->magic, RENDER_MAGIC, 4) != 0)
+    {
+        unmapFile(&render);
+        return false;
+    }
+
+    if (header->version != RENDER_VERSION || header->sample_rate != ISR_HZ)
+    {
+        fprintf(stderr, "%s is render version %u at %u Hz, expected %u at %u Hz\n", path, header->version, header->sample_rate, RENDER_VERSION, ISR_HZ);
+        exit(1);
+    }
+    const size_t len = (size_t)header->frame_count * 8;
+    if (render.len < sizeof(RenderHeader) + len)
+    {
+        fprintf(stderr, "%s is truncated\n", path);
+        exit(1);
+    }
+
+    serial_port = openSerial(device);
+    const uint8_t *const frames = render.data + sizeof(RenderHeader);
+    const uint32_t skipped = start < header->frame_count ? start : header->frame_count;
+    for (size_t off = (size_t)skipped * 8; off < len; off += REPLAY_CHUNK)
+    {
+        if (!writeSerial(serial_port, frames + off, len - off < REPLAY_CHUNK ? len - off : REPLAY_CHUNK))
+        {
+            fprintf(stderr, "Error writing to the serial port\n");
+            exit(1);
+        }
+    }
+    closeSerial(serial_port);
+    unmapFile(&render);
+    printf("%u frames written\n", header->frame_count - skipped);
+    return true;
+}
+
+// render a show straight to the laser, at most RING_BLOCKS blocks ahead of the serial writer.
+// with small blocks an instruction reaches the wire within a few blocks of being admitted.
+void playShow(const char *const path, const char *const device, const uint32_t start)
+{
+    uint32_t max_time, block = 0;
+    pthread_t writer;
+    bool writing = false;
+
+    loadShow(path, &max_time);
+    uint32_t next_instruction = seekShow(start);
+    serial_port = openSerial(device);
+    ring.limit = block_len * RING_BLOCKS < RING_LEN ? block_len * RING_BLOCKS : RING_LEN;
+
+    for (uint32_t i = start; i < max_time; i += block_len, ++block)
+    {
+        ring.admitted_us[block % STAMP_LEN] = nowMicros();
+        admitInstructions(&next_instruction, i, i + block_len);
+        solveCycles(i, true);
+        pushBlock();
+
+        // start writing once there is a block queued up
+        if (!writing)
+        {
+            if (pthread_create(&writer, NULL, serialWriter, NULL) != 0)
+            {
+                fprintf(stderr, "Error starting the serial writer\n");
+                exit(1);
+            }
+            writing = true;
+        }
+    }
+    atomic_store_explicit(&ring.done, true, memory_order_release);
+    if (writing)
+        pthread_join(writer, NULL);
+
+    closeSerial(serial_port);
+    unmapFile(&show_file);
+    printf("%llu frames written, %u underruns, %u stalls\n", (unsigned long long)ring.frames_written, ring.underruns, ring.stalls);
+    if (ring.blocks_written)
+        printf("%u sample blocks, latency %.2f ms average, %.2f ms worst\n", block_len,
+            ring.latency_sum_us / 1000.0 / ring.blocks_written, ring.latency_max_us / 1000.0);
+    if (dropped_instructions)
+        printf("%u instructions dropped\n", dropped_instructions);
+}
+
+// a run of blocks for a render thread: the cycle table as it stood when the first one started, and the blocks packed
+typedef struct
+{
+    Cycle cycles[NUM_CYCLES];
+    SlotMask live, attr_live;
+    int newest;
+    IdMap ids;
+    uint32_t next_instruction;
+    uint32_t time;
+    uint32_t blocks;
+    bool done; // packed and ready to be written
+    uint8_t packed[(ISR_HZ > JOB_SAMPLES ? ISR_HZ : JOB_SAMPLES) * 8];
+}
+BlockJob;
+
+// blocks on their way through the render threads. the main thread queues them in show order and
+// writes them out in the same order, each worker takes whichever job is next.
+typedef struct
+{
+    BlockJob *jobs;  // a ring, job n is jobs[n % slots]
+    uint32_t slots;
+    uint32_t queued; // jobs handed to the workers so far
+    uint32_t taken;  // jobs a worker has started on
+    bool stop;       // no more jobs are coming
+    pthread_mutex_t lock;
+    pthread_cond_t work; // a job was queued or 'stop' was set
+    pthread_cond_t done; // a job was packed
+}
+RenderQueue;
+
+RenderQueue render_queue;
+
+// a render thread, alive for the whole render. its modulation buffers and laser are its own
+// and are set up once, the first time it needs them.
+void *renderWorker(void *arg)
+{
+    (void)arg;
+    replaying = true;
+    for (;;)
+    {
+        pthread_mutex_lock(&render_queue.lock);
+        while (render_queue.taken == render_queue.queued && !render_queue.stop)
+            pthread_cond_wait(&render_queue.work, &render_queue.lock);
+        if (render_queue.taken == render_queue.queued)
+        {
+            pthread_mutex_unlock(&render_queue.lock);
+            break;
+        }
+        BlockJob *const job = &render_queue.jobs[render_queue.taken++ % render_queue.slots];
+        pthread_mutex_unlock(&render_queue.lock);
+
+        memcpy(cycles, job->cycles, sizeof(cycles));
+        live = job->live;
+        attr_live = job->attr_live;
+        newest = job->newest;
+        ids = job->ids;
+        uint32_t next_instruction = job->next_instruction;
+        for (uint32_t b = 0, i = job->time; b < job->blocks; ++b, i += block_len)
+        {
+            admitInstructions(&next_instruction, i, i + block_len);
+            solveCycles(i, true);
+            packBlock(&laser, job->packed + (size_t)b * block_len * 8);
+        }
+
+        pthread_mutex_lock(&render_queue.lock);
+        job->done = true;
+        pthread_cond_signal(&render_queue.done);
+        pthread_mutex_unlock(&render_queue.lock);
+    }
+    freeModulation();
+    return NULL;
+}
+
+// write finished jobs out in show order, waiting until no more than 'pending' are left unwritten
+void writeFinished(uint32_t *const written, const uint32_t pending)
+{
+    pthread_mutex_lock(&render_queue.lock);
+    for (;;)
+    {
+        const BlockJob *const job = &render_queue.jobs[*written % render_queue.slots];
+        if (*written < render_queue.queued && job->done)
+        {
+            pthread_mutex_unlock(&render_queue.lock);
+            fwrite(job->packed, 1, (size_t)job->blocks * block_len * 8, fp);
+            pthread_mutex_lock(&render_queue.lock);
+            ++*written;
+        }
+        else if (render_queue.queued - *written > pending)
+            pthread_cond_wait(&render_queue.done, &render_queue.lock);
+        else
+            break;
+    }
+    pthread_mutex_unlock(&render_queue.lock);
+}
+
+// render on 'threads' workers fed from a ring of jobs. the main thread walks the cycle table from
+// block to block without drawing and queues the table as it stood at the start of each job, so the walk
+// runs ahead while the workers draw and pack. small blocks are handed out JOB_SAMPLES at a time so the
+// hand over doesn't cost more than the drawing. every block is solved by the same code from the same
+// table, so the output matches a one thread render.
+void renderParallel(const uint32_t start, const uint32_t max_time, const int threads)
+{
+    uint32_t next_instruction = seekShow(start), written = 0;
+    const uint32_t blocks_per_job = block_len < JOB_SAMPLES ? JOB_SAMPLES / block_len : 1;
+    render_queue.slots = threads * 2; // a job per worker and another one waiting for each
+    render_queue.jobs = malloc(render_queue.slots * sizeof(BlockJob));
+    pthread_t *const workers = malloc(threads * sizeof(pthread_t));
+    if (render_queue.jobs == NULL || workers == NULL)
+    {
+        fprintf(stderr, "Out of memory for render threads\n");
+        exit(1);
+    }
+    pthread_mutex_init(&render_queue.lock, NULL);
+    pthread_cond_init(&render_queue.work, NULL);
+    pthread_cond_init(&render_queue.done, NULL);
+    for (int k = 0; k < threads; ++k)
+    {
+        if (pthread_create(&workers[k], NULL, renderWorker, NULL) != 0)
+        {
+            fprintf(stderr, "Error starting a render thread\n");
+            exit(1);
+        }
+    }
+
+    for (uint32_t i = start; i < max_time;)
+    {
+        BlockJob *const job = &render_queue.jobs[render_queue.queued % render_queue.slots];
+        memcpy(job->cycles, cycles, sizeof(cycles));
+        job->live = live;
+        job->attr_live = attr_live;
+        job->newest = newest;
+        job->ids = ids;
+        job->next_instruction = next_instruction;
+        job->time = i;
+        job->blocks = (max_time - i + block_len - 1) / block_len;
+        job->blocks = job->blocks < blocks_per_job ? job->blocks : blocks_per_job;
+        job->done = false;
+
+        // the worker starts on it straight away and redoes the admissions of the later blocks itself
+        pthread_mutex_lock(&render_queue.lock);
+        ++render_queue.queued;
+        pthread_cond_signal(&render_queue.work);
+        pthread_mutex_unlock(&render_queue.lock);
+
+        for (uint32_t b = 0; b < job->blocks; ++b, i += block_len)
+        {
+            admitInstructions(&next_instruction, i, i + block_len);
+            solveCycles(i, false);
+        }
+        // a slot has to be written out before the next job can have it
+        writeFinished(&written, render_queue.slots - 1);
+    }
+    writeFinished(&written, 0);
+
+    pthread_mutex_lock(&render_queue.lock);
+    render_queue.stop = true;
+    pthread_cond_broadcast(&render_queue.work);
+    pthread_mutex_unlock(&render_queue.lock);
+    for (int k = 0; k < threads; ++k)
+        pthread_join(workers[k], NULL);
+
+    pthread_mutex_destroy(&render_queue.lock);
+    pthread_cond_destroy(&render_queue.work);
+    pthread_cond_destroy(&render_queue.done);
+    free(render_queue.jobs);
+    free(workers);
+}
+
+// the quarter wave lookup table the oscillators used before the wave kernel, only kept for 'check-wave'
+float lut_arr[(1<<16) + 2];
+
+void fillLut()
+{
+    for (int i = 0; i < 1<<16; i++)
+        lut_arr[i] = sinf(((double)i) / LUT_HIGH * M_PI_2);
+}
+
+float lutSine(const float x_rad)
+{
+    const long x = ((long) ((x_rad >= 0 ? x_rad : -x_rad + M_PI) / M_PI * 2 * (1<<16))) & ((1<<18) - 1);
+    if (x < (1<<16))
+        return lut_arr[x];
+    else if (x < (1<<16)*2-1)
+        return lut_arr[2 * LUT_HIGH - x];
+    else if (x < (1<<16)*3-1)
+        return -lut_arr[x - LUT_HIGH * 2 - 1];
+    else
+        return -lut_arr[4 * LUT_HIGH - x];
+}
+
+float lutCosine(const float x_rad)
+{
+    const long x = ((long) ((x_rad >= 0 ? x_rad : -x_rad) / M_PI * (float)(1<<17))) & ((1<<18) - 1);
+    static const int num = (1<<16);
+    if (x < (1<<16))
+        return lut_arr[num - x - 1];
+    else if (x < (1<<16)*2)
+        return -lut_arr[x - num];
+    else if (x < (1<<16)*3)
+        return -lut_arr[num * 3 - x - 1];
+    else
+        return lut_arr[x - 3 * num];
+}
+
+// the largest of 'worst' and |got - want|
+static inline double worse(const double worst, const double got, const double want)
+{
+    return fabs(got - want) > worst ? fabs(got - want) : worst;
+}
+
+// 'check-wave': how far the wave kernel is from sin() / cos() and from the lookup table it replaced,
+// first on arguments spread over two turns either side of 0, then through the phase accumulators of
+// cycles running up to an hour into a show. false if anything is off by more than WAVE_ERROR or LUT_ERROR.
+bool checkWave()
+{
+    fillLut();
+    double lut_err = 0, kernel_err = 0, kernel_lut_err = 0;
+    for (int base = 0; base < CHECK_WAVE_POINTS; base += ISR_HZ)
+    {
+        const int n = CHECK_WAVE_POINTS - base < ISR_HZ ? CHECK_WAVE_POINTS - base : ISR_HZ;
+        for (int k = 0; k < n; ++k)
+            arg_buf[k] = (float)(((double)(base + k) / CHECK_WAVE_POINTS * 4.0 - 2.0) * M_PI * 2.0);
+        for (uint8_t wave = SINE; wave <= COSINE; ++wave)
+        {
+            waveSpan(arg_buf, wave_buf, n, wave);
+            for (int k = 0; k < n; ++k)
+            {
+                const double exact = wave == SINE ? sin(arg_buf[k]) : cos(arg_buf[k]);
+                const float old = wave == SINE ? lutSine(arg_buf[k]) : lutCosine(arg_buf[k]);
+                lut_err = worse(lut_err, old, exact);
+                kernel_err = worse(kernel_err, wave_buf[k], exact);
+                kernel_lut_err = worse(kernel_lut_err, wave_buf[k], old);
+            }
+        }
+    }
+    printf("%d arguments in [-4pi, 4pi)\n", CHECK_WAVE_POINTS);
+    printf("  lookup table vs sin/cos %.3g\n", lut_err);
+    printf("  waveSpan vs sin/cos     %.3g\n", kernel_err);
+    printf("  waveSpan vs table       %.3g\n", kernel_lut_err);
+
+    // a second of samples at a few points in the show, for a spread of frequencies.
+    // the exact angle comes straight from the 64 bit accumulator.
+    static const float hzs[] = {0.37f, 7.584f, 60.0f, 440.0f, 1000.0f, 4321.5f, 12345.6f};
+    static const uint32_t starts[] = {0, 12345, ISR_HZ * 60, ISR_HZ * 60 * 30, ISR_HZ * 60 * 60};
+    double acc_err = 0, acc_lut_err = 0;
+    for (size_t h = 0; h < sizeof(hzs) / sizeof(hzs[0]); ++h)
+    {
+        const uint64_t inc = phaseIncrement(hzs[h]);
+        for (size_t s = 0; s < sizeof(starts) / sizeof(starts[0]); ++s)
+        {
+            for (uint8_t wave = SINE; wave <= COSINE; ++wave)
+            {
+                uint64_t acc = (uint64_t)starts[s] * inc;
+                for (int k = 0; k < ISR_HZ; ++k, acc += inc)
+                    arg_buf[k] = (float)(int32_t)(acc >> 32) * acc_convert;
+                waveSpan(arg_buf, wave_buf, ISR_HZ, wave);
+
+                acc = (uint64_t)starts[s] * inc;
+                for (int k = 0; k < ISR_HZ; ++k, acc += inc)
+                {
+                    const double angle = (double)(int64_t)acc * (M_PI * 2.0 / 18446744073709551616.0);
+                    const double exact = wave == SINE ? sin(angle) : cos(angle);
+                    const float old = wave == SINE ? lutSine((float)angle) : lutCosine((float)angle);
+                    acc_err = worse(acc_err, wave_buf[k], exact);
+                    acc_lut_err = worse(acc_lut_err, wave_buf[k], old);
+                }
+            }
+        }
+    }
+    printf("%zu cycles through the phase accumulator, up to an hour in\n", sizeof(hzs) / sizeof(hzs[0]) * sizeof(starts) / sizeof(starts[0]) * 2);
+    printf("  accumulator vs sin/cos  %.3g\n", acc_err);
+    printf("  accumulator vs table    %.3g\n", acc_lut_err);
+
+    const bool ok = kernel_err <= WAVE_ERROR && acc_err <= WAVE_ERROR && kernel_lut_err <= LUT_ERROR && acc_lut_err <= LUT_ERROR;
+    printf("%s (bounds %.3g against sin/cos, %.3g against the table)\n", ok ? "OK" : "FAILED", WAVE_ERROR, LUT_ERROR);
+    return ok;
+}
+
+// synthetic show for 'bench': 'count' cycles all running for BENCH_SECONDS.
+// kinds are "pos", "color", "attr" (half of them modulating the other half) and "rotate" (half rotating the rest)
+CompiledCycle *benchShow(const char *const kind, const uint32_t count)
+{
+    CompiledCycle *const show = calloc(count, sizeof(CompiledCycle));
+    if (show == NULL)
+    {
+        fprintf(stderr, "Out of memory for the bench show\n");
+        exit(1);
+    }
+
+    uint32_t seed = 12345;
+    const uint32_t plain = strcmp(kind, "attr") == 0 || strcmp(kind, "rotate") == 0 ? count - count / 2 : count;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        CompiledCycle *const in = &show[i];
+        seed = seed * 1664525u + 1013904223u;
+        in->end = BENCH_SECONDS * ISR_HZ;
+        in->hz = 20.0f + (seed >> 8) % 2000;
+        in->phase = (seed & 255) / 40.0f;
+        in->low = 0;
+        in->high = 4095.0f / plain;
+        in->wave = seed & 1 ? SINE : COSINE;
+
+        if (strcmp(kind, "color") == 0)
+        {
+            in->target = TARGET_R + i % 3;
+            in->low = (seed >> 4) % 32;
+        }
+        else if (i < plain)
+            in->target = i & 1 ? TARGET_Y : TARGET_X;
+        else if (strcmp(kind, "attr") == 0)
+        {
+            in->target = TARGET_HIGH + i % 3;
+            in->target_index = i - plain;
+            in->hz = in->hz / 100.0f;
+            in->high = in->target == TARGET_PHASE ? 3.0f : 4095.0f / plain;
+        }
+        else
+        {
+            in->target = TARGET_ROTATE;
+            in->hz = in->hz / 1000.0f;
+            in->center_x = 2048;
+            in->center_y = 2048;
+        }
+    }
+    return show;
+}
+
+// 'bench' [previous bench output]: renders synthetic shows of every kind from 1 cycle up to NUM_CYCLES
+// and reports the speed of each stage. 'solve' is admission and the cycle table, 'wave' the sine and cosine
+// spans, 'rotate' composing and applying the rotations, 'pack' the frames to wire bytes.
+// the checksum covers every packed byte, so an optimization that changes the output shows up
+// as a different checksum, and is flagged if a previous run is given.
+void bench(const char *const baseline_path)
+{
+    static const char *const kinds[] = {"pos", "color", "attr", "rotate"};
+    static const uint32_t counts[] = {1, 4, 16, 64, 256, 1024};
+    static LaserBytes frames[ISR_HZ];
+    static uint8_t packed[ISR_HZ * 8];
+    FILE *const baseline = baseline_path ? fopen(baseline_path, "r") : NULL;
+    if (baseline_path && baseline == NULL)
+    {
+        fprintf(stderr, "Error opening %s\n", baseline_path);
+        exit(1);
+    }
+    int mismatches = 0;
+
+    // the wave kernel on its own, the inner loop of every cycle
+    for (int k = 0; k < ISR_HZ; ++k)
+        arg_buf[k] = (k % 1000) * 0.00628f - 3.14f;
+    uint64_t start = nowMicros();
+    for (int rep = 0; rep < 100; ++rep)
+        waveSpan(arg_buf, wave_buf, ISR_HZ, rep & 1 ? SINE : COSINE);
+    printf("wave: %.2f ns/sample (%d wide)\n", (nowMicros() - start) * 1000.0 / (100.0 * ISR_HZ), WAVE_WIDTH);
+    printf("%-7s %6s %9s %12s %10s %10s %10s %10s %10s\n", "kind", "cycles", "checksum", "Msamples/s", "solve ns", "wave ns", "rotate ns", "pack ns", "realtime");
+    timing_stages = true;
+
+    for (size_t t = 0; t < sizeof(kinds) / sizeof(kinds[0]); ++t)
+    {
+        for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]) && counts[c] <= NUM_CYCLES; ++c)
+        {
+            CompiledCycle *const show = benchShow(kinds[t], counts[c]);
+            instructions = show;
+            num_instructions = counts[c];
+            clearCycles();
+
+            uint32_t next_instruction = 0, checksum = 2166136261u; // FNV-1a
+            uint64_t solve_us = 0, pack_us = 0;
+            wave_ns = rotate_ns = 0;
+            for (uint32_t i = 0; i < BENCH_SECONDS * ISR_HZ; i += block_len)
+            {
+                start = nowMicros();
+                admitInstructions(&next_instruction, i, i + block_len);
+                solveCycles(i, true);
+                const uint64_t solved = nowMicros();
+                for (uint32_t k = 0; k < block_len; ++k)
+                    frameAt(&laser, k, &frames[k]);
+                pack(frames, packed, block_len * 8);
+                pack_us += nowMicros() - solved;
+                solve_us += solved - start;
+
+                for (uint32_t k = 0; k < block_len * 8; ++k)
+                    checksum = (checksum ^ packed[k]) * 16777619u;
+            }
+            free(show);
+
+            const double samples = (double)BENCH_SECONDS * ISR_HZ;
+            const double total_s = (solve_us + pack_us) / 1e6;
+            const double stages_us = (wave_ns + rotate_ns) / 1000.0;
+            printf("%-7s %6u %08x %12.2f %10.2f %10.2f %10.2f %10.2f %9.1fx", kinds[t], counts[c], checksum,
+                samples / total_s / 1e6, (solve_us - stages_us) * 1000.0 / samples, wave_ns / samples, rotate_ns / samples,
+                pack_us * 1000.0 / samples, samples / total_s / ISR_HZ);
+
+            // find the same case in the previous run
+            if (baseline)
+            {
+                char line[256], kind[16];
+                unsigned cycles, expected;
+                bool found = false;
+                rewind(baseline);
+                while (!found && fgets(line, sizeof(line), baseline))
+                    found = sscanf(line, "%15s %u %x", kind, &cycles, &expected) == 3 && strcmp(kind, kinds[t]) == 0 && cycles == counts[c];
+                if (!found)
+                    printf("  (not in %s)", baseline_path);
+                else if (expected != checksum)
+                {
+                    printf("  CHANGED, was %08x", expected);
+                    ++mismatches;
+                }
+            }
+            putchar('\n');
+        }
+    }
+    timing_stages = false;
+    if (baseline)
+    {
+        fclose(baseline);
+        printf(mismatches ? "%d outputs changed\n" : "all outputs match\n", mismatches);
+    }
+}
+
+// decompress [-j threads] [-b block samples] [-s start seconds] [instructions.txt | show.bin] [render.bin]
+// decompress [-b block samples] bench [previous bench output]
+// decompress check-wave
+// decompress compile [instructions.txt] [show.bin]
+// decompress [-b block samples] [-s start seconds] play [instructions.txt | show.bin | render.bin] [serial device]
+int main(int argc, char **argv)
+{
+    int threads = 1;
+    uint32_t start = 0;
+    for (; argc > 2 && argv[1][0] == '-'; argc -= 2, argv += 2)
+    {
+        if (strcmp(argv[1], "-j") == 0)
+        {
+            threads = atoi(argv[2]);
+            threads = threads < 1 ? 1 : threads;
+        }
+        else if (strcmp(argv[1], "-b") == 0)
+        {
+            const int len = atoi(argv[2]);
+            block_len = len < 1 ? 1 : (len > ISR_HZ ? ISR_HZ : len);
+        }
+        else if (strcmp(argv[1], "-s") == 0)
+        {
+            const double seconds = atof(argv[2]);
+            start = seconds > 0 ? (uint32_t)(seconds * ISR_HZ + 0.5) : 0;
+        }
+        else
+            break;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        bench(argc > 2 ? argv[2] : NULL);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "check-wave") == 0)
+        return checkWave() ? 0 : 1;
+    if (argc > 1 && strcmp(argv[1], "compile") == 0)
+    {
+        compileInstructions(argc > 2 ? argv[2] : INSTRUCTIONS_FILE, argc > 3 ? argv[3] : SHOW_FILE);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "play") == 0)
+    {
+        const char *const path = argc > 2 ? argv[2] : INSTRUCTIONS_FILE;
+        const char *const device = argc > 3 ? argv[3] : SERIAL_DEVICE;
+        if (!replayRender(path, device, start))
+            playShow(path, device, start);
+        return 0;
+    }
+
+    uint32_t max_time;
+    loadShow(argc > 1 ? argv[1] : INSTRUCTIONS_FILE, &max_time);
+    start = start < max_time ? start : max_time;
+    const char *const out_path = argc > 2 ? argv[2] : RENDER_FILE;
+    fp = fopen(out_path, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Error opening %s\n", out_path);
+        exit(1);
+    }
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+    writeRenderHeader(max_time - start);
+
+    if (threads > 1)
+        renderParallel(start, max_time, threads);
+    else
+    {
+        uint32_t next_instruction = seekShow(start);
+        for (uint32_t i = start; i < max_time; i += block_len)
+        {
+            admitInstructions(&next_instruction, i, i + block_len);
+            solveCycles(i, true);
+            writeBlock(&laser);
+        }
     }
     fclose(fp);
+    unmapFile(&show_file);
+    if (dropped_instructions)
+        printf("%u instructions dropped\n", dropped_instructions);
     puts("DONE");
     return 0;
 }
@@ -463,15 +2407,11 @@ int main()
 
 // TODO
 /* 
-    * make an instructions compiler so that they can be read quickly in the form of a struct.
-    * install some logic to handle if an instruction is too old to keep around.
-    * read for new instruction every second.
     * determine if a pile of 64 instructions is enough of a buffer for one second.
-    * make the rotate function the very last thing that happens to the x and y position.
-    * make a linear change function
-    * make an absolute value instruction
-    * position color control with angle. 
-        make all variables of color control addressable from a pointer from another instruction
-    * temporal color control
+    * make a linear change function
+    * make an absolute value instruction
+    * position color control with angle. 
+        make all variables of color control addressable from a pointer from another instruction
+    * temporal color control
     * function type should be the first arg as it tells the number and type of values
-*/
\ No newline at end of file
+*/
\ No newline at end of file
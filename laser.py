@@ -1,6 +1,8 @@
-from ctypes import c_int, c_float, POINTER, CDLL
+from ctypes import c_int, c_float, c_double, c_char_p, c_uint64, POINTER, CDLL, Structure
 import os, numpy as np, platform
+from numpy.ctypeslib import ndpointer
 import pickle
+import struct
 from typing import Optional
 from rich import print
 
@@ -11,11 +13,49 @@ else:
     from ctypes import CDLL
     DLL = CDLL
 
+ISR_HZ = 40000
+FRAMES_PER_SECOND = ISR_HZ / 256  # send_to_laser() renders 256 samples a call
+STAT_BUCKETS = 16
+WIRE_RAW, WIRE_COMPRESSED = 0, 1  # set_wire_format() in serial.c, the laser has to expect the same
+EASE_LINEAR, EASE_IN_SINE, EASE_OUT_SINE, EASE_IN_OUT_SINE = range(4)  # send_transition() curves
+
+# the dll is built from serial.c, see the top of that file. Windows needs -lws2_32 for serve_laser()
+DLL_BUILD = 'gcc -O3 -march=native -shared -o laser.dll serial.c -lws2_32'
+DLL_EXPORTS = ('send_to_laser', 'send_samples', 'send_timeline', 'send_transition', 'flush_laser',
+               'set_serial_port', 'set_batch_size', 'set_wire_format', 'set_loop_period', 'bytes_per_write',
+               'laser_stats', 'reset_laser_stats', 'serve_laser', 'score_patterns')
+
+class LaserStats(Structure):
+    # LaserStats in serial.c. times are microseconds, histogram bucket i counts 2^i to 2^(i+1) us
+    _fields_ = [(name, c_uint64) for name in (
+        'frames', 'samples', 'render_us', 'render_max_us', 'pack_us', 'pack_max_us',
+        'writes', 'write_us', 'write_max_us', 'bytes_written', 'bytes_queued',
+        'samples_late', 'underruns', 'frames_looped')] + [
+        ('render_hist', c_uint64 * STAT_BUCKETS), ('write_hist', c_uint64 * STAT_BUCKETS)]
+
+# PatternScore in serial.c, one per pattern score_patterns() is given
+PATTERN_SCORE = np.dtype([(name, np.float32) for name in (
+    'coverage', 'fill', 'density', 'symmetry_x', 'symmetry_y', 'symmetry_r')])
+
+# the fixed layout ControlMessage in serial.c: magic, pair counts, rgb, 3 spare bytes, then 8 (hz, amp) pairs each for x and y
+CONTROL_PORT = 65432
+MAX_PAIRS = 8
+CONTROL_FORMAT = '<4s5B3x' + 'f' * (MAX_PAIRS * 4)
+
+def control_message(x_pairs: list, y_pairs: list, rgb: list) -> bytes:
+    # one update for the control server, [(hz, amp 0 - 1), ...] for x and y and [r, g, b]
+    x_pairs, y_pairs = list(x_pairs)[:MAX_PAIRS], list(y_pairs)[:MAX_PAIRS]
+    pairs = []
+    for p in (x_pairs, y_pairs):
+        flat = [float(v) for pair in p for v in pair]
+        pairs += flat + [0.0] * (MAX_PAIRS * 2 - len(flat))
+    return struct.pack(CONTROL_FORMAT, b'LCTL', len(x_pairs), len(y_pairs), *[int(c) for c in rgb], *pairs)
+
 class Laser:
 
-    str_to_int = {'X': 0, 'Y': 1, 'R': 2, 'G': 3, 'B': 4, 'XOFF': 5, 'YOFF': 6, 'ROTATE': 7}
+    str_to_int = {'X': 0, 'Y': 1, 'R': 2, 'G': 3, 'B': 4, 'XOFF': 5, 'YOFF': 6, 'ROTATE': 7, 'AL': 8, 'AR': 9}
 
-    def __init__(self, dll_path: str = r"C:\Users\jlaus\Documents\Programming\Laser Lightshow\laser.dll"):
+    def __init__(self, dll_path: str = r"C:\Users\jlaus\Documents\Programming\Laser Lightshow\laser.dll", device: Optional[str] = None, baud: int = 0, batch_bytes: int = 0, compress: bool = False):
         if not os.path.exists(dll_path):
             raise FileNotFoundError(f"Cannot find DLL: {dll_path}")
         
@@ -24,7 +64,17 @@ class Laser:
         
         self.lib = DLL(dll_path)
         self._handle = self.lib._handle  # for proper unloading if needed
+        missing = [name for name in DLL_EXPORTS if not hasattr(self.lib, name)]
+        if missing:
+            raise RuntimeError(f"{dll_path} is older than serial.c, it has no {', '.join(missing)}. Rebuild it with: {DLL_BUILD}")
         self._init_bindings()
+        self._stats = self.lib.laser_stats().contents  # the dll's own counters, always current
+        if device is not None or baud:
+            self.lib.set_serial_port(device.encode() if device is not None else None, baud)
+        if batch_bytes:
+            self.lib.set_batch_size(batch_bytes)
+        if compress:
+            self.lib.set_wire_format(WIRE_COMPRESSED)
         self.init_serial()
 
     @staticmethod
@@ -67,6 +117,34 @@ class Laser:
     
     def off(self):
         self.send([['R', 0], ['B', 0], ['G', 0]])
+        self.flush()
+
+    def flush(self):
+        # sends are batched in the dll, push out whatever is still waiting
+        self.lib.flush_laser()
+
+    def bytes_per_write(self) -> float:
+        return self.lib.bytes_per_write()
+
+    def stats(self) -> dict:
+        # a snapshot of the send path counters, cheap enough to poll during a show
+        snap = {name: getattr(self._stats, name) for name, _ in LaserStats._fields_}
+        snap['render_hist'] = list(snap['render_hist'])
+        snap['write_hist'] = list(snap['write_hist'])
+        return snap
+
+    def reset_stats(self):
+        self.lib.reset_laser_stats()
+
+    def loop_period(self, samples: int = 0):
+        # a call sent again unchanged plays one rendered period from memory.
+        # 0 finds the period itself, -1 always renders live, anything else is taken as the period in samples
+        self.lib.set_loop_period(samples)
+
+    def serve(self, port: int = CONTROL_PORT, udp: bool = False):
+        # hands the laser to the control server in the dll, never returns unless the server can't start
+        if self.lib.serve_laser(port, int(udp)) != 0:
+            raise RuntimeError("serve_laser() could not start the control server")
 
     def _init_bindings(self):
         self.lib.send_to_laser.argtypes = [
@@ -77,6 +155,57 @@ class Laser:
         ]
         self.lib.send_to_laser.restype = None
 
+        self.lib.set_serial_port.argtypes = [c_char_p, c_int]
+        self.lib.set_serial_port.restype = None
+
+        self.lib.set_batch_size.argtypes = [c_int]
+        self.lib.set_batch_size.restype = None
+
+        self.lib.set_wire_format.argtypes = [c_int]
+        self.lib.set_wire_format.restype = None
+
+        self.lib.set_loop_period.argtypes = [c_int]
+        self.lib.set_loop_period.restype = None
+
+        self.lib.flush_laser.argtypes = []
+        self.lib.flush_laser.restype = None
+
+        self.lib.bytes_per_write.argtypes = []
+        self.lib.bytes_per_write.restype = c_double
+
+        self.lib.laser_stats.argtypes = []
+        self.lib.laser_stats.restype = POINTER(LaserStats)
+
+        self.lib.reset_laser_stats.argtypes = []
+        self.lib.reset_laser_stats.restype = None
+
+        self.lib.serve_laser.argtypes = [c_int, c_int]
+        self.lib.serve_laser.restype = c_int
+
+        # numpy arrays go straight through, ndpointer refuses anything that would need a copy
+        u16 = ndpointer(dtype=np.uint16, flags='C_CONTIGUOUS')
+        u8 = ndpointer(dtype=np.uint8, flags='C_CONTIGUOUS')
+        self.lib.send_samples.argtypes = [c_int, u16, u16, u8, u8, u8]
+        self.lib.send_samples.restype = None
+
+        self.lib.send_timeline.argtypes = [
+            c_int,
+            c_int,
+            ndpointer(dtype=np.float32, flags='C_CONTIGUOUS'),
+            ndpointer(dtype=np.int32, flags='C_CONTIGUOUS'),
+            c_int
+        ]
+        self.lib.send_timeline.restype = None
+
+        f32 = ndpointer(dtype=np.float32, flags='C_CONTIGUOUS')
+        i32 = ndpointer(dtype=np.int32, flags='C_CONTIGUOUS')
+        self.lib.send_transition.argtypes = [c_int, f32, f32, i32, c_int, c_int, c_int]
+        self.lib.send_transition.restype = None
+
+        self.lib.score_patterns.argtypes = [c_int, c_int, i32, f32, f32, c_int, c_int,
+                                            ndpointer(dtype=PATTERN_SCORE, flags='C_CONTIGUOUS')]
+        self.lib.score_patterns.restype = None
+
     def init_serial(self):
         arr_np = np.ascontiguousarray([0], dtype=np.float32)
         types_np = np.ascontiguousarray([0], dtype=np.int32)
@@ -87,21 +216,65 @@ class Laser:
         self.lib.send_to_laser(0, arr_ptr, types_ptr, 1)
 
     def show(self, arr: list, amp=16, seconds=1, first = True):
-        self.send(arr + [['G', amp], ['R', amp], ['B', amp]], first=first)
-        for i in range(round(seconds * 159)):
-            self.send(arr + [['G', amp], ['R', amp], ['B', amp]], first=False)
-        self.send([['R', 0], ['B', 0], ['G', 0]])
+        row, types = self.flatten(arr + [['G', amp], ['R', amp], ['B', amp]])
+        self.send_timeline(np.tile(row, (1 + round(seconds * FRAMES_PER_SECOND), 1)), types, first=first)
+        self.off()
+
+    def flatten(self, arr: list) -> tuple[np.ndarray, np.ndarray]:
+        # [['X', hz, amp], ['R', value], ...] -> the values and type ids send_to_laser() reads
+        values = []
+        for i in arr:
+            if i[0] in ['X', 'Y', 'ROTATE', 'AL', 'AR']:
+                values.extend(list(i[1:]))
+            else:
+                values.append(i[1])
+        return np.array(values, dtype=np.float32), np.array([self.str_to_int[i[0]] for i in arr], dtype=np.int32)
+
+    def send_timeline(self, params: np.ndarray, types: np.ndarray, first=True):
+        # one row of flatten() values per 256 sample frame, all sent in a single call
+        params = np.ascontiguousarray(params, dtype=np.float32)
+        types = np.ascontiguousarray(types, dtype=np.int32)
+        self.lib.send_timeline(len(params), len(types), params, types, int(first))
+
+    def score(self, patterns: list, seconds: float = 0.1, threads: int = 0) -> np.ndarray:
+        # patterns like random_chord() gives them, rendered in the dll without the laser and measured on
+        # a coarse grid. one PATTERN_SCORE row per pattern, threads 0 uses every processor
+        waves = max([len(p) for p in patterns] + [1])
+        types = np.full((len(patterns), waves), -1, dtype=np.int32)
+        hz = np.zeros((len(patterns), waves), dtype=np.float32)
+        amps = np.zeros((len(patterns), waves), dtype=np.float32)
+        for n, pattern in enumerate(patterns):
+            for k, wave in enumerate(w for w in pattern if w[0] in ('X', 'Y')):
+                types[n, k], hz[n, k], amps[n, k] = self.str_to_int[wave[0]], wave[1], wave[2]
+        out = np.zeros(len(patterns), dtype=PATTERN_SCORE)
+        self.lib.score_patterns(len(patterns), waves, types, hz, amps, round(seconds * ISR_HZ), threads, out)
+        return out
+
+    def search(self, count: int = 5000, keep: int = 20, key=lambda s: s['fill'] * s['density'], **chord_args) -> list:
+        # the best 'keep' of 'count' random_chord()s by 'key' of their scores, best first, as (pattern, score)
+        patterns = [self.random_chord(**chord_args) for _ in range(count)]
+        scores = self.score(patterns)
+        best = np.argsort(-key(scores))[:keep]
+        return [(patterns[i], scores[i]) for i in best]
+
+    def transition(self, start: list, end: list, seconds: float, easing: int = EASE_IN_OUT_SINE, first=False):
+        # start and end like send() takes them, the same entries in the same order.
+        # the dll eases every value from one to the other sample by sample, one call for the whole move
+        start_row, types = self.flatten(start)
+        end_row, end_types = self.flatten(end)
+        if not np.array_equal(types, end_types):
+            raise ValueError("start and end need the same entries in the same order")
+        self.lib.send_transition(len(types), start_row, end_row, types, round(seconds * ISR_HZ), easing, int(first))
+
+    def send_samples(self, x: np.ndarray, y: np.ndarray, r: np.ndarray, g: np.ndarray, b: np.ndarray):
+        # raw samples from arrays the caller owns and refills: x, y uint16 0 - 4095, r, g, b uint8
+        if not len(x) == len(y) == len(r) == len(g) == len(b):
+            raise ValueError("sample arrays must all be the same length")
+        self.lib.send_samples(len(x), x, y, r, g, b)
 
     def send(self, arr: list[float] | dict, types: list[int] = None, first=True):
         if types is None:
-            arr2 = []
-            for i in arr:
-                if i[0] in ['X', 'Y', 'ROTATE']:
-                    arr2.extend(list(i[1:]))
-                else:
-                    arr2.append(i[1]) 
-            arr_np = np.ascontiguousarray(arr2, dtype=np.float32)
-            types_np = np.ascontiguousarray([self.str_to_int[i[0]] for i in arr], dtype=np.int32)
+            arr_np, types_np = self.flatten(arr)
             num_types = len(arr)
         else:
             arr_np = np.ascontiguousarray(arr, dtype=np.float32)
@@ -120,25 +293,22 @@ class Laser:
             while r+g+b < 35:
                 r, g, b = np.random.random(3) * amp + 6
             rgb_rot = [['G', g], ['R', r], ['B', b]]
-
-            self.send([[k[0], k[1], k[2] * 0] for k in i] + [['XOFF', 2048], ['YOFF', 2048], *rgb_rot], first=True)
-
-            for j, off in zip(np.linspace(0, np.pi/2, tranistion), np.linspace(np.pi/2, 0, tranistion)):
-                j = np.sin(j)
-                off = (1 - j) * 2048
-                self.send([[k[0], k[1], k[2] * j] for k in i] + [['XOFF', off], ['YOFF', off], *rgb_rot], first=False)
-
-            for j in range(round(seconds * 159)):
-                self.send(i + [['G', g], ['R', r], ['B', b]], first=False)
-
-            for j, off in zip(np.linspace(np.pi/2, 0, tranistion), np.linspace(0, np.pi/2, tranistion)):
-                j = np.sin(j)
-                off = (1 - j) * 2048
-                self.send([[k[0], k[1], k[2] * j] for k in i] + [['XOFF', off], ['YOFF', off], *rgb_rot], first=False)
+            hidden = [[k[0], k[1], k[2] * 0] for k in i] + [['XOFF', 2048], ['YOFF', 2048], *rgb_rot]
+            held = i + [['XOFF', 0], ['YOFF', 0], *rgb_rot]
+
+            # the fades are eased per sample in the dll, 'tranistion' frames long. the hold plays from its loop
+            fade = tranistion / FRAMES_PER_SECOND
+            self.transition(hidden, held, fade, EASE_OUT_SINE, first=True)
+            row, types = self.flatten(held)
+            self.send_timeline(np.tile(row, (round(seconds * FRAMES_PER_SECOND), 1)), types, first=False)
+            self.transition(held, hidden, fade, EASE_IN_SINE)
         d = 0
         self.send([['X', 0], ['Y', 2000], ['XOFF', 0], ['YOFF', 0], *rgb_rot])
+        self.flush()
 
     def _shutdown(self):
+        if self.lib is not None:
+            self.flush()
         self.lib = None
         self._handle = None
 
@@ -152,4 +322,5 @@ if __name__ == '__main__':
     d = 10
     for i in range(1000):
         las.send([['X', 200, .3], ['Y', 200.2, .3], ['XOFF', 1000], ['YOFF', 1000], ['R', d], ['B', d], ['G', d], ['ROTATE', i / 1000 * np.pi * 2, 2048, 2048]], first=False)
-    las.send([['X', 200, 0], ['Y', 200.2, 0], ['XOFF', 0], ['YOFF', 0], ['R', 0], ['B', 0], ['G', 0]], first=False)
\ No newline at end of file
+    las.send([['X', 200, 0], ['Y', 200.2, 0], ['XOFF', 0], ['YOFF', 0], ['R', 0], ['B', 0], ['G', 0]], first=False)
+    las.flush()
\ No newline at end of file
@@ -1,28 +1,32 @@
 import streamlit as st
 import socket
-import json
+from laser import control_message, CONTROL_PORT
 
 # -- Config --
 LASER_HOST = '127.0.0.1'
-LASER_PORT = 65432
-
-def send_to_laser_server(x_pairs, y_pairs, rgb):
-    msg = json.dumps({
-        'x': x_pairs,
-        'y': y_pairs,
-        'rgb': rgb
-    }).encode('utf-8')
-    try:
-        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
-            s.connect((LASER_HOST, LASER_PORT))
-            s.sendall(msg)
-    except Exception as e:
-        st.error(f"Socket error: {e}")
+LASER_PORT = CONTROL_PORT
 
 # -- State setup --
 st.set_page_config(layout='wide')
 ss = st.session_state
 
+def send_to_laser_server(x_pairs, y_pairs, rgb):
+    # one connection for the whole session, opened again if the server went away
+    msg = control_message(x_pairs, y_pairs, rgb)
+    for attempt in range(2):
+        try:
+            if ss.get('laser_sock') is None:
+                ss.laser_sock = socket.create_connection((LASER_HOST, LASER_PORT))
+                ss.laser_sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            ss.laser_sock.sendall(msg)
+            return
+        except OSError as e:
+            if ss.get('laser_sock') is not None:
+                ss.laser_sock.close()
+            ss.laser_sock = None
+            if attempt:
+                st.error(f"Socket error: {e}")
+
 # Defaults
 if 'x_freqs' not in ss: ss.x_freqs = [200.0, 400.0, 600.0, 800.0]
 if 'x_amps' not in ss: ss.x_amps = [0.0, 0.0, 0.0, 0.0]
@@ -1,10 +1,39 @@
+// laser.py loads this as a dll. the dll isn't kept in the repo, build it and rebuild it whenever this file changes:
+//   Windows (MinGW): gcc -O3 -march=native -shared -o laser.dll serial.c -lws2_32
+//   Linux:           gcc -O3 -march=native -shared -fPIC -pthread -o laser.so serial.c -lm
+// the command line tool is the same without -shared / -fPIC, e.g. -o serial.exe.
+// -lws2_32 is needed on Windows for the sockets serve_laser() uses.
+#ifndef _WIN32
+#define _GNU_SOURCE // cfmakeraw() and the pseudo terminal calls
+#endif
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
-#include <windows.h>
 #include <sys/time.h>
+#include <stdatomic.h>
+#ifdef _WIN32
+#include <winsock2.h> // before windows.h, link with -lws2_32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <termios.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#endif
+// pack_arrays() uses the widest vectors the compiler allows, build with -O3 -march=native for AVX2
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 typedef struct 
 {
@@ -12,11 +41,195 @@ typedef struct
     uint16_t laser_x, laser_y, audio_l, audio_r;
 } Data;
 
+// the same samples as an array of Data, one array per field
+typedef struct
+{
+    const uint8_t *r, *g, *b;
+    const uint16_t *laser_x, *laser_y, *audio_l, *audio_r;
+} DataArrays;
+
+#ifndef ISR_HZ // set with -DISR_HZ=..., same as decompress.c
 #define ISR_HZ 40000//50000
+#endif
+
+#ifdef _WIN32
+#define SERIAL_DEVICE "\\\\.\\COM3"
+typedef HANDLE SerialPort;
+#else
+#define SERIAL_DEVICE "/dev/ttyUSB0"
+typedef int SerialPort;
+#endif
+#define SERIAL_BAUD 1000000
+#define BATCH_BYTES 8192      // packed bytes sent per write by default, 1024 samples
+#define MAX_BATCH_BYTES 65536
+#define MAX_OSCILLATORS 32    // XHZ / YHZ / AUDIO entries one send_to_laser() call can have
+#define CONTROL_PORT 65432
+#define CONTROL_MAGIC "LCTL"
+#define MAX_PAIRS 8           // X and Y (hz, amp) pairs one control message can carry
+#define MAX_CONTROL_CLIENTS 8
+#define CONTROL_FRESH 4       // set in control_middle when it holds an update the renderer hasn't taken
+#define STAT_BUCKETS 16       // histogram bucket i counts times of 2^i to 2^(i+1) microseconds, the last one anything longer
+#define LATE_RESTART_US 50000 // this far behind the sample clock the stream is counted as an underrun and restarted
+#define MAX_LOOP_SAMPLES (ISR_HZ * 2) // longest period send_to_laser() will loop, longer ones are rendered live
+#define MAX_LOOP_TYPES 64     // calls with more entries than this are always rendered live
+#define MAX_LOOP_PARAMS 192
+#define LOOP_ERROR 0.25f      // counts a wave may be off where a loop wraps
+#define SCORE_GRID 64         // score_patterns() occupancy grid, cells a side
+#define MAX_SCORE_THREADS 64
+#define WIRE_RAW 0            // set_wire_format(): pack() frames as they are, 8 bytes a sample
+#define WIRE_COMPRESSED 1     // packets from wire_encode(), the laser has to be built for them
+#define WIRE_SYNC 0xA5        // first byte of every compressed packet
+#define WIRE_HEADER 8
+#define WIRE_MAX_SAMPLES 256  // per packet
+#define WIRE_KEY_INTERVAL 16  // packets between keyframes, about 0.1 s at ISR_HZ
+#define WIRE_KEY 1            // packet flags
+#define WIRE_AUDIO 2
+#define WIRE_PLAIN 4
+#define WIRE_MAX_PACKET (WIRE_HEADER + 16 + WIRE_MAX_SAMPLES * 12) // a keyframe, a pair byte, four 2 byte residuals and a colour run per sample
+
+enum {XHZ, YHZ, RED, GREEN, BLUE, XOFF, YOFF, ROTATE, AUDIO_L, AUDIO_R}TYPES; // AUDIO_L / AUDIO_R take hz, amp like XHZ
+enum {EASE_LINEAR, EASE_IN_SINE, EASE_OUT_SINE, EASE_IN_OUT_SINE}EASINGS; // send_transition() curves
+
+// one XHZ / YHZ / AUDIO entry of send_to_laser(), kept between calls so the wave carries on where it left off
+typedef struct
+{
+    uint32_t phase; // 1 << 32 is one full turn
+    uint32_t inc;   // turns per sample, same scale
+    float amp;
+    int live;       // was used by the last call
+} Oscillator;
+
+// one control update, the same 140 bytes over TCP and UDP, little endian.
+// a TCP connection stays open and carries one message after another.
+typedef struct __attribute__((packed))
+{
+    char magic[4];           // CONTROL_MAGIC
+    uint8_t x_count;         // pairs of 'x' that are used
+    uint8_t y_count;
+    uint8_t r, g, b;
+    uint8_t reserved[3];
+    float x[MAX_PAIRS][2];   // hz, amp 0 - 1
+    float y[MAX_PAIRS][2];
+} ControlMessage;
+
+// running counters for everything sent, read in place from Python through laser_stats().
+// only the thread calling into the dll writes them, so they are plain counters, cheap enough to leave on.
+typedef struct
+{
+    uint64_t frames;        // 256 sample frames rendered by send_to_laser()
+    uint64_t samples;       // samples packed, from any of the send calls
+    uint64_t render_us, render_max_us; // send_to_laser() up to packing, per frame
+    uint64_t pack_us, pack_max_us;     // pack_arrays() into the batch buffer
+    uint64_t writes;        // write calls that moved bytes
+    uint64_t write_us, write_max_us;   // time spent handing bytes to the port, waiting for room included
+    uint64_t bytes_written;
+    uint64_t bytes_queued;  // packed but not taken by the port yet
+    uint64_t samples_late;  // samples packed after the ISR_HZ clock said the laser needed them
+    uint64_t underruns;     // times the stream fell LATE_RESTART_US behind and the clock started over
+    uint64_t frames_looped; // frames send_to_laser() replayed from a loop instead of rendering
+    uint64_t render_hist[STAT_BUCKETS];
+    uint64_t write_hist[STAT_BUCKETS];
+} LaserStats;
+
+// what score_patterns() measures of one pattern, read from Python as a structured numpy array.
+// all of it comes from how long the beam spends in each cell of a SCORE_GRID square grid
+typedef struct
+{
+    float coverage;   // share of the grid the beam crosses
+    float fill;       // share of its own bounding box it crosses
+    float density;    // how evenly the time is spread over the cells it crosses, 1 when they all get the same
+    float symmetry_x; // time that lines up with the pattern mirrored left to right in its bounding box, 0 - 1
+    float symmetry_y; // mirrored top to bottom
+    float symmetry_r; // turned half way round
+} PatternScore;
+
+// candidates are handed out one at a time to whichever thread is free
+typedef struct
+{
+    int count, waves, samples;
+    const int *types;  // count x waves of XHZ / YHZ, anything else is skipped
+    const float *hz, *amp;
+    PatternScore *out;
+    _Atomic int next;
+} ScoreJob;
+
+// a held send_to_laser() call: its parameters, and one period of what it draws, packed.
+// sums of sines repeat, so once the same call comes twice the period is rendered once and replayed.
+typedef struct
+{
+    int len;         // -1 when the last call can't be looped
+    int types[MAX_LOOP_TYPES];
+    float arr[MAX_LOOP_PARAMS];
+    int tried;       // the period has been looked for
+    int samples;     // the period, 0 while rendering live
+    int cursor;      // the next sample to send
+    int oscillators; // how many the call uses, kept in step with the loop so live rendering carries on from it
+    uint32_t phase[MAX_OSCILLATORS]; // theirs where the loop starts
+} Loop;
+
+typedef struct
+{
+    uint8_t last[16]; // the two frames the next packet is predicted from, older first
+    uint8_t seq;
+    int since_key;   // packets since the last keyframe, WIRE_KEY_INTERVAL sends one
+} WireEncoder;
+
+// the reference decoder for WIRE_COMPRESSED, fed one byte at a time as the laser receives them
+typedef struct
+{
+    uint8_t packet[WIRE_MAX_PACKET];
+    int have, need;     // bytes of the packet so far, and its length once the header is in
+    uint8_t last[16];   // the last two frames decoded, older first
+    uint8_t seq;        // the sequence number expected next
+    int synced;         // last is good: a keyframe came in and nothing has been lost since
+    uint8_t frames[WIRE_MAX_SAMPLES * 8]; // the packet just completed, as pack() frames
+    uint64_t packets;
+    uint64_t dropped;   // packets thrown away, damaged or waiting for a keyframe
+} WireDecoder;
+
+#ifdef _WIN32
+typedef SOCKET Socket;
+#define close_socket closesocket
+#else
+typedef int Socket;
+#define INVALID_SOCKET -1
+#define close_socket close
+#endif
 
-enum {XHZ, YHZ, RED, GREEN, BLUE, XOFF, YOFF, ROTATE}TYPES;
+SerialPort serial_conn;
+char serial_device[256] = SERIAL_DEVICE;
+int serial_baud = SERIAL_BAUD;
+LaserStats stats;
+uint64_t clock_start_us; // when sample 0 of the current stream was due
+uint64_t clock_samples;  // samples packed since then
+Oscillator oscillators[MAX_OSCILLATORS];
+Loop loop = {.len = -1};
+int loop_period;  // set_loop_period(): 0 looks for the period, -1 never loops, anything else is the period
+uint8_t loop_packed[(MAX_LOOP_SAMPLES / 256 + 2) * 256 * 8]; // a period and a frame more, so a frame never wraps
 
-HANDLE serial_conn;
+// the frame send_to_laser() renders into
+uint8_t render_r[256], render_g[256], render_b[256];
+uint16_t render_x[256], render_y[256], render_al[256], render_ar[256];
+const DataArrays render_data = {render_r, render_g, render_b, render_x, render_y, render_al, render_ar};
+
+// control updates are triple buffered: the server fills control_back, swaps it for control_middle,
+// and the renderer swaps control_middle for control_front when it is fresh. neither side ever waits.
+ControlMessage control_slots[3];
+_Atomic int control_middle = 1;
+int control_back = 0;  // only touched by the control server
+int control_front = 2; // only touched by the renderer
+
+// packed samples are collected here and written a batch at a time.
+// one buffer is filled while the other may still be going out.
+uint8_t batch_buf[2][MAX_BATCH_BYTES];
+int batch_bytes = BATCH_BYTES;
+int batch_fill;
+int batch_current;
+const uint8_t *pending; // the part of the other buffer not written yet
+size_t pending_len;
+int wire_format = WIRE_RAW;
+WireEncoder wire_enc = {.since_key = WIRE_KEY_INTERVAL};
+uint8_t wire_frames[WIRE_MAX_SAMPLES * 8]; // pack() output waiting for wire_encode()
 
 void packOLD(const Data *const data_array, uint8_t *const arr, int num_bytes)
 {
@@ -96,41 +309,801 @@ void pack(const Data *const data_array, uint8_t *const arr, int num_bytes)
     }
 }
 
-void pack_arr(HANDLE hSerial, const Data *const data_array, uint8_t *const packed)
+// pack() for one sample of a DataArrays
+static inline void pack_one(const DataArrays *const d, const int i, uint8_t *const packed)
+{
+    packed[0]  =  (d->r[i] > 31 ? 31 : d->r[i]) & 0b00011111;
+    packed[0] |= (d->g[i] & 0b00000111) << 5;
+    packed[1]  = (((d->g[i] > 31 ? 31 : d->g[i]) >> 3) & 0b00000011);
+    packed[1] |= ((d->b[i] > 31 ? 31 : d->b[i]) & 0b00011111) << 2;
+    packed[2] =   d->laser_x[i];
+    packed[3] = ((d->laser_x[i] >> 8) & 0x0F) | ((d->laser_y[i] << 4) & 0xF0);
+    packed[4] =   d->laser_y[i] >> 4;
+    packed[5] =   d->audio_l[i];
+    packed[6] = ((d->audio_l[i] >> 8) & 0x0F) | ((d->audio_r[i] << 4) & 0xF0);
+    packed[7] =   d->audio_r[i] >> 4;
+}
+
+// the same bytes as pack(), from one array per field.
+// each of the 8 wire bytes is built for a whole vector of samples, then they are interleaved.
+void pack_arrays(const DataArrays *const d, uint8_t *const arr, const int count)
 {
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256i max_color = _mm256_set1_epi8(31);
+    const __m256i low_byte = _mm256_set1_epi16(0x00FF);
+    const __m256i low_nibble = _mm256_set1_epi16(0x000F);
+    const __m256i high_nibble = _mm256_set1_epi16(0x00F0);
+    for (; i + 32 <= count; i += 32)
+    {
+        const __m256i g = _mm256_loadu_si256((const __m256i*)(d->g + i));
+        const __m256i r = _mm256_min_epu8(_mm256_loadu_si256((const __m256i*)(d->r + i)), max_color);
+        const __m256i gc = _mm256_min_epu8(g, max_color);
+        const __m256i b = _mm256_min_epu8(_mm256_loadu_si256((const __m256i*)(d->b + i)), max_color);
+
+        // no 8 bit shifts, so shift 16 bits and mask off what crossed into the neighbour
+        const __m256i b0 = _mm256_or_si256(r, _mm256_and_si256(_mm256_slli_epi16(g, 5), _mm256_set1_epi8((char)0xE0)));
+        const __m256i b1 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(gc, 3), _mm256_set1_epi8(0x03)),
+                                           _mm256_and_si256(_mm256_slli_epi16(b, 2), _mm256_set1_epi8(0x7C)));
+
+        // 16 bit fields give two vectors of 16 samples each, packed down to bytes.
+        // packus works within 128 bit lanes so the result is put back in sample order after.
+        __m256i w[2][6];
+        for (int h = 0; h < 2; ++h)
+        {
+            const __m256i x = _mm256_loadu_si256((const __m256i*)(d->laser_x + i + h * 16));
+            const __m256i y = _mm256_loadu_si256((const __m256i*)(d->laser_y + i + h * 16));
+            const __m256i al = _mm256_loadu_si256((const __m256i*)(d->audio_l + i + h * 16));
+            const __m256i ar = _mm256_loadu_si256((const __m256i*)(d->audio_r + i + h * 16));
+            w[h][0] = _mm256_and_si256(x, low_byte);
+            w[h][1] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(x, 8), low_nibble), _mm256_and_si256(_mm256_slli_epi16(y, 4), high_nibble));
+            w[h][2] = _mm256_and_si256(_mm256_srli_epi16(y, 4), low_byte);
+            w[h][3] = _mm256_and_si256(al, low_byte);
+            w[h][4] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(al, 8), low_nibble), _mm256_and_si256(_mm256_slli_epi16(ar, 4), high_nibble));
+            w[h][5] = _mm256_and_si256(_mm256_srli_epi16(ar, 4), low_byte);
+        }
+        const __m256i b2 = _mm256_permute4x64_epi64(_mm256_packus_epi16(w[0][0], w[1][0]), 0xD8);
+        const __m256i b3 = _mm256_permute4x64_epi64(_mm256_packus_epi16(w[0][1], w[1][1]), 0xD8);
+        const __m256i b4 = _mm256_permute4x64_epi64(_mm256_packus_epi16(w[0][2], w[1][2]), 0xD8);
+        const __m256i b5 = _mm256_permute4x64_epi64(_mm256_packus_epi16(w[0][3], w[1][3]), 0xD8);
+        const __m256i b6 = _mm256_permute4x64_epi64(_mm256_packus_epi16(w[0][4], w[1][4]), 0xD8);
+        const __m256i b7 = _mm256_permute4x64_epi64(_mm256_packus_epi16(w[0][5], w[1][5]), 0xD8);
+
+        // 8 x 32 bytes -> 32 x 8 bytes
+        const __m256i p01l = _mm256_unpacklo_epi8(b0, b1), p01h = _mm256_unpackhi_epi8(b0, b1);
+        const __m256i p23l = _mm256_unpacklo_epi8(b2, b3), p23h = _mm256_unpackhi_epi8(b2, b3);
+        const __m256i p45l = _mm256_unpacklo_epi8(b4, b5), p45h = _mm256_unpackhi_epi8(b4, b5);
+        const __m256i p67l = _mm256_unpacklo_epi8(b6, b7), p67h = _mm256_unpackhi_epi8(b6, b7);
+        const __m256i q[8] = {
+            _mm256_unpacklo_epi16(p01l, p23l), _mm256_unpackhi_epi16(p01l, p23l),
+            _mm256_unpacklo_epi16(p01h, p23h), _mm256_unpackhi_epi16(p01h, p23h),
+            _mm256_unpacklo_epi16(p45l, p67l), _mm256_unpackhi_epi16(p45l, p67l),
+            _mm256_unpacklo_epi16(p45h, p67h), _mm256_unpackhi_epi16(p45h, p67h),
+        };
+        __m256i o[8];
+        for (int k = 0; k < 4; ++k)
+        {
+            o[k * 2] = _mm256_unpacklo_epi32(q[k], q[k + 4]);
+            o[k * 2 + 1] = _mm256_unpackhi_epi32(q[k], q[k + 4]);
+        }
+
+        // the low lanes hold samples 0 - 15, the high lanes 16 - 31
+        uint8_t *const out = &arr[i * 8];
+        for (int k = 0; k < 8; k += 2)
+        {
+            _mm256_storeu_si256((__m256i*)(out + k * 16), _mm256_permute2x128_si256(o[k], o[k + 1], 0x20));
+            _mm256_storeu_si256((__m256i*)(out + 128 + k * 16), _mm256_permute2x128_si256(o[k], o[k + 1], 0x31));
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i max_color = _mm_set1_epi8(31);
+    const __m128i low_byte = _mm_set1_epi16(0x00FF);
+    const __m128i low_nibble = _mm_set1_epi16(0x000F);
+    const __m128i high_nibble = _mm_set1_epi16(0x00F0);
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i g = _mm_loadu_si128((const __m128i*)(d->g + i));
+        const __m128i r = _mm_min_epu8(_mm_loadu_si128((const __m128i*)(d->r + i)), max_color);
+        const __m128i gc = _mm_min_epu8(g, max_color);
+        const __m128i b = _mm_min_epu8(_mm_loadu_si128((const __m128i*)(d->b + i)), max_color);
+
+        // no 8 bit shifts, so shift 16 bits and mask off what crossed into the neighbour
+        const __m128i b0 = _mm_or_si128(r, _mm_and_si128(_mm_slli_epi16(g, 5), _mm_set1_epi8((char)0xE0)));
+        const __m128i b1 = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(gc, 3), _mm_set1_epi8(0x03)),
+                                        _mm_and_si128(_mm_slli_epi16(b, 2), _mm_set1_epi8(0x7C)));
+
+        __m128i w[2][6];
+        for (int h = 0; h < 2; ++h)
+        {
+            const __m128i x = _mm_loadu_si128((const __m128i*)(d->laser_x + i + h * 8));
+            const __m128i y = _mm_loadu_si128((const __m128i*)(d->laser_y + i + h * 8));
+            const __m128i al = _mm_loadu_si128((const __m128i*)(d->audio_l + i + h * 8));
+            const __m128i ar = _mm_loadu_si128((const __m128i*)(d->audio_r + i + h * 8));
+            w[h][0] = _mm_and_si128(x, low_byte);
+            w[h][1] = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 8), low_nibble), _mm_and_si128(_mm_slli_epi16(y, 4), high_nibble));
+            w[h][2] = _mm_and_si128(_mm_srli_epi16(y, 4), low_byte);
+            w[h][3] = _mm_and_si128(al, low_byte);
+            w[h][4] = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(al, 8), low_nibble), _mm_and_si128(_mm_slli_epi16(ar, 4), high_nibble));
+            w[h][5] = _mm_and_si128(_mm_srli_epi16(ar, 4), low_byte);
+        }
+        const __m128i b2 = _mm_packus_epi16(w[0][0], w[1][0]);
+        const __m128i b3 = _mm_packus_epi16(w[0][1], w[1][1]);
+        const __m128i b4 = _mm_packus_epi16(w[0][2], w[1][2]);
+        const __m128i b5 = _mm_packus_epi16(w[0][3], w[1][3]);
+        const __m128i b6 = _mm_packus_epi16(w[0][4], w[1][4]);
+        const __m128i b7 = _mm_packus_epi16(w[0][5], w[1][5]);
+
+        // 8 x 16 bytes -> 16 x 8 bytes
+        const __m128i p01l = _mm_unpacklo_epi8(b0, b1), p01h = _mm_unpackhi_epi8(b0, b1);
+        const __m128i p23l = _mm_unpacklo_epi8(b2, b3), p23h = _mm_unpackhi_epi8(b2, b3);
+        const __m128i p45l = _mm_unpacklo_epi8(b4, b5), p45h = _mm_unpackhi_epi8(b4, b5);
+        const __m128i p67l = _mm_unpacklo_epi8(b6, b7), p67h = _mm_unpackhi_epi8(b6, b7);
+        const __m128i q[8] = {
+            _mm_unpacklo_epi16(p01l, p23l), _mm_unpackhi_epi16(p01l, p23l),
+            _mm_unpacklo_epi16(p01h, p23h), _mm_unpackhi_epi16(p01h, p23h),
+            _mm_unpacklo_epi16(p45l, p67l), _mm_unpackhi_epi16(p45l, p67l),
+            _mm_unpacklo_epi16(p45h, p67h), _mm_unpackhi_epi16(p45h, p67h),
+        };
+        uint8_t *const out = &arr[i * 8];
+        for (int k = 0; k < 4; ++k)
+        {
+            _mm_storeu_si128((__m128i*)(out + k * 32), _mm_unpacklo_epi32(q[k], q[k + 4]));
+            _mm_storeu_si128((__m128i*)(out + k * 32 + 16), _mm_unpackhi_epi32(q[k], q[k + 4]));
+        }
+    }
+#endif
+    for (; i < count; ++i)
+        pack_one(d, i, &arr[(size_t)i * 8]);
+}
+
+// the 12 bit fields of a pack() frame
+static inline int frame_x(const uint8_t *const f) { return f[2] | ((f[3] & 0x0F) << 8); }
+static inline int frame_y(const uint8_t *const f) { return (f[3] >> 4) | (f[4] << 4); }
+static inline int frame_al(const uint8_t *const f) { return f[5] | ((f[6] & 0x0F) << 8); }
+static inline int frame_ar(const uint8_t *const f) { return (f[6] >> 4) | (f[7] << 4); }
+
+static inline void set_frame(uint8_t *const f, const int x, const int y, const int al, const int ar)
+{
+    f[2] = x;
+    f[3] = ((x >> 8) & 0x0F) | ((y << 4) & 0xF0);
+    f[4] = y >> 4;
+    f[5] = al;
+    f[6] = ((al >> 8) & 0x0F) | ((ar << 4) & 0xF0);
+    f[7] = ar >> 4;
+}
+
+// the next value of a channel if it carries on in a straight line, modulo 4096.
+// waves bend slowly at ISR_HZ, so what is left over is a few counts
+static inline int predict(const int last, const int before)
+{
+    return (2 * last - before) & 0xFFF;
+}
+
+// a residual modulo 4096: -64 to 63 in one byte, anything else in two with the top bit set
+static inline uint8_t *put_residual(uint8_t *p, const int d)
+{
+    if (d < 64 || d >= 4096 - 64)
+    {
+        *p++ = d & 0x7F;
+        return p;
+    }
+    *p++ = 0x80 | (d >> 8);
+    *p++ = d;
+    return p;
+}
+
+// the x and y residuals share a byte when both are -7 to 7.
+// a nibble of 8 says that channel follows on its own, x first
+static inline uint8_t *put_pair(uint8_t *p, const int dx, const int dy)
+{
+    const int nx = dx <= 7 || dx >= 4096 - 7 ? dx & 0x0F : 8;
+    const int ny = dy <= 7 || dy >= 4096 - 7 ? dy & 0x0F : 8;
+    *p++ = nx << 4 | ny;
+    if (nx == 8)
+        p = put_residual(p, dx);
+    if (ny == 8)
+        p = put_residual(p, dy);
+    return p;
+}
+
+// fletcher16 carried on from 'sum' over [p, end)
+static inline uint16_t fletcher16(const uint16_t sum, const uint8_t *p, const uint8_t *const end)
+{
+    uint16_t a = sum & 0xFF, b = sum >> 8;
+    for (; p < end; ++p)
+    {
+        a = (a + *p) % 255;
+        b = (b + a) % 255;
+    }
+    return a | b << 8;
+}
+
+// a packet's check: fletcher16 of header bytes 1 - 5 (everything but the sync byte and the check itself), then the body
+static inline uint16_t wire_check(const uint8_t *const packet, const uint8_t *const end)
+{
+    return fletcher16(fletcher16(0, packet + 1, packet + 6), packet + WIRE_HEADER, end);
+}
+
+// up to WIRE_MAX_SAMPLES frames from pack() as one packet, returns its length.
+// header: WIRE_SYNC, sequence number, samples - 1, flags, body length and wire_check(), both little endian.
+// body: under WIRE_KEY the two frames before the first, then every sample's x and y residual from predict(),
+// audio residuals too under WIRE_AUDIO (otherwise it holds), then runs of (samples - 1, the two colour bytes).
+// a packet that would come out bigger than the frames themselves is sent as WIRE_PLAIN, the frames as they are.
+int wire_encode(WireEncoder *const enc, const uint8_t *const frames, const int count, uint8_t *const out)
+{
+    uint8_t *p = out + WIRE_HEADER;
+    uint8_t flags = 0;
+    if (enc->since_key >= WIRE_KEY_INTERVAL)
+    {
+        flags |= WIRE_KEY;
+        memcpy(p, enc->last, 16);
+        p += 16;
+    }
+    for (int i = 0; i < count; ++i)
+        if (memcmp(&frames[i * 8 + 5], &enc->last[8 + 5], 3) != 0)
+        {
+            flags |= WIRE_AUDIO;
+            break;
+        }
+
+    const uint8_t *before = enc->last, *last = enc->last + 8;
+    for (int i = 0; i < count; ++i)
+    {
+        const uint8_t *const f = &frames[i * 8];
+        p = put_pair(p, (frame_x(f) - predict(frame_x(last), frame_x(before))) & 0xFFF,
+                        (frame_y(f) - predict(frame_y(last), frame_y(before))) & 0xFFF);
+        if (flags & WIRE_AUDIO)
+        {
+            p = put_residual(p, (frame_al(f) - predict(frame_al(last), frame_al(before))) & 0xFFF);
+            p = put_residual(p, (frame_ar(f) - predict(frame_ar(last), frame_ar(before))) & 0xFFF);
+        }
+        before = last;
+        last = f;
+    }
+    for (int i = 0; i < count;)
+    {
+        int run = 1;
+        while (i + run < count && frames[(i + run) * 8] == frames[i * 8] && frames[(i + run) * 8 + 1] == frames[i * 8 + 1])
+            ++run;
+        *p++ = run - 1;
+        *p++ = frames[i * 8];
+        *p++ = frames[i * 8 + 1];
+        i += run;
+    }
+    if (p - out - WIRE_HEADER > count * 8)
+    {
+        flags = WIRE_PLAIN;
+        memcpy(out + WIRE_HEADER, frames, count * 8);
+        p = out + WIRE_HEADER + count * 8;
+    }
+    memcpy(enc->last, count > 1 ? &frames[(count - 2) * 8] : enc->last + 8, 8);
+    memcpy(enc->last + 8, &frames[(count - 1) * 8], 8);
+
+    const int body = p - out - WIRE_HEADER;
+    out[0] = WIRE_SYNC;
+    out[1] = enc->seq++;
+    out[2] = count - 1;
+    out[3] = flags;
+    out[4] = body;
+    out[5] = body >> 8;
+    const uint16_t check = wire_check(out, p);
+    out[6] = check;
+    out[7] = check >> 8;
+    // a plain packet is as good as a keyframe if it holds the two frames the next one predicts from
+    enc->since_key = (flags & WIRE_KEY) || ((flags & WIRE_PLAIN) && count >= 2) ? 1 : enc->since_key + 1;
+    return p - out;
+}
+
+uint64_t now_us()
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(count.QuadPart / (double)freq.QuadPart * 1e6);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static inline void add_time(uint64_t *const hist, const uint64_t us)
+{
+    const int bucket = us ? 64 - __builtin_clzll(us) - 1 : 0;
+    ++hist[bucket < STAT_BUCKETS ? bucket : STAT_BUCKETS - 1];
+}
+
+void record_write(const size_t bytes, const uint64_t us)
+{
+    stats.bytes_written += bytes;
+    ++stats.writes;
+    stats.write_us += us;
+    stats.write_max_us = us > stats.write_max_us ? us : stats.write_max_us;
+    add_time(stats.write_hist, us);
+}
+
+// 'count' samples are about to be packed: were they in time for the sample clock?
+void clock_samples_out(const int count)
+{
+    const uint64_t now = now_us();
+    const uint64_t due = clock_start_us + clock_samples * 1000000 / ISR_HZ;
+    if (clock_samples == 0 || now > due + LATE_RESTART_US)
+    {
+        if (clock_samples)
+            ++stats.underruns;
+        clock_start_us = now;
+        clock_samples = 0;
+    }
+    else if (now > due)
+        stats.samples_late += count;
+    clock_samples += count;
+    stats.samples += count;
+}
+
+// writes all of 'len' bytes, however many calls that takes
+void write_serial(SerialPort hSerial, const uint8_t *data, size_t len)
+{
+#ifdef _WIN32
     DWORD bytesWritten;
+    const uint64_t start = now_us();
+    WriteFile(hSerial, data, len, &bytesWritten, NULL);
+    record_write(bytesWritten, now_us() - start);
+#else
+    uint64_t start = now_us();
+    while (len > 0)
+    {
+        const ssize_t n = write(hSerial, data, len);
+        if (n > 0)
+        {
+            const uint64_t now = now_us();
+            record_write(n, now - start);
+            start = now;
+            data += n;
+            len -= n;
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+            // the port is non blocking, wait for room in the output buffer
+            struct pollfd pfd = {.fd = hSerial, .events = POLLOUT};
+            poll(&pfd, 1, -1);
+        }
+        else if (n < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "Error writing to %s\n", serial_device);
+            exit(0);
+        }
+    }
+#endif
+}
+
+// the reverse of pack(), for one 8 byte frame
+void unpack(const uint8_t *const packed, Data *const data)
+{
+    data->r = packed[0] & 0b00011111;
+    data->g = (packed[0] >> 5) | ((packed[1] & 0b00000011) << 3);
+    data->b = (packed[1] >> 2) & 0b00011111;
+    data->laser_x = packed[2] | ((packed[3] & 0x0F) << 8);
+    data->laser_y = (packed[3] >> 4) | (packed[4] << 4);
+    data->audio_l = packed[5] | ((packed[6] & 0x0F) << 8);
+    data->audio_r = (packed[6] >> 4) | (packed[7] << 4);
+}
+
+// the reverse of put_residual(), -1 if the packet ends first
+static inline int get_residual(const uint8_t **const p, const uint8_t *const end)
+{
+    if (*p >= end)
+        return -1;
+    const int b = *(*p)++;
+    if (!(b & 0x80))
+        return (b & 0x40 ? b - 0x80 : b) & 0xFFF;
+    if (*p >= end)
+        return -1;
+    return (b & 0x0F) << 8 | *(*p)++;
+}
+
+// one nibble of put_pair()
+static inline int get_nibble(const uint8_t **const p, const uint8_t *const end, const int n)
+{
+    return n == 8 ? get_residual(p, end) : (n & 0x08 ? n - 16 : n) & 0xFFF;
+}
+
+// the complete packet in dec->packet into dec->frames, returns the sample count or 0 if it can't be used
+static int wire_decode(WireDecoder *const dec)
+{
+    const uint8_t *const h = dec->packet;
+    const uint8_t *p = h + WIRE_HEADER, *const end = h + dec->need;
+    const int count = h[2] + 1;
+    const int gap = h[1] != dec->seq;
+    dec->seq = h[1] + 1;
+    ++dec->packets;
+
+    int ok = wire_check(h, end) == (h[6] | h[7] << 8);
+    if (ok && (h[3] & WIRE_PLAIN))
+    {
+        ok = end - p == count * 8;
+        if (ok)
+            memcpy(dec->frames, p, count * 8);
+        p = end;
+        // a single frame leaves the older of the two the next packet predicts from as it was,
+        // so it only keeps the stream in sync, it can't bring it back
+        if (count >= 2)
+            dec->synced = ok;
+        else if (gap)
+            dec->synced = 0;
+    }
+    else
+    {
+        if (ok && (h[3] & WIRE_KEY) && end - p >= 16)
+        {
+            memcpy(dec->last, p, 16);
+            p += 16;
+            dec->synced = 1;
+        }
+        else if (gap)
+            dec->synced = 0;
+        ok = ok && dec->synced;
+
+        const uint8_t *before = dec->last, *last = dec->last + 8;
+        for (int i = 0; ok && i < count; ++i)
+        {
+            uint8_t *const f = &dec->frames[i * 8];
+            ok = p < end;
+            const int pair = ok ? *p++ : 0;
+            const int dx = get_nibble(&p, end, pair >> 4);
+            const int dy = get_nibble(&p, end, pair & 0x0F);
+            ok = ok && dx >= 0 && dy >= 0;
+            int al = frame_al(last), ar = frame_ar(last); // audio holds unless WIRE_AUDIO
+            if (h[3] & WIRE_AUDIO)
+            {
+                const int dl = get_residual(&p, end), dr = get_residual(&p, end);
+                ok = ok && dl >= 0 && dr >= 0;
+                al = (predict(al, frame_al(before)) + dl) & 0xFFF;
+                ar = (predict(ar, frame_ar(before)) + dr) & 0xFFF;
+            }
+            set_frame(f, (predict(frame_x(last), frame_x(before)) + dx) & 0xFFF,
+                         (predict(frame_y(last), frame_y(before)) + dy) & 0xFFF, al, ar);
+            before = last;
+            last = f;
+        }
+        for (int i = 0; ok && i < count;)
+        {
+            const int run = end - p >= 3 ? p[0] + 1 : 0;
+            ok = run > 0 && run <= count - i;
+            for (int k = 0; ok && k < run; ++k, ++i)
+            {
+                dec->frames[i * 8] = p[1];
+                dec->frames[i * 8 + 1] = p[2];
+            }
+            p += 3;
+        }
+    }
+
+    if (!ok || p != end)
+    {
+        dec->synced = 0;
+        ++dec->dropped;
+        return 0;
+    }
+    memcpy(dec->last, count > 1 ? &dec->frames[(count - 2) * 8] : dec->last + 8, 8);
+    memcpy(dec->last + 8, &dec->frames[(count - 1) * 8], 8);
+    return count;
+}
+
+// returns the samples this byte completed into dec->frames, 0 while a packet is still coming in
+int wire_feed(WireDecoder *const dec, const uint8_t byte)
+{
+    if (dec->have == 0 && byte != WIRE_SYNC)
+        return 0; // looking for the start of a packet
+    dec->packet[dec->have++] = byte;
+    if (dec->have == WIRE_HEADER)
+    {
+        dec->need = WIRE_HEADER + (dec->packet[4] | dec->packet[5] << 8);
+        if (dec->need > WIRE_MAX_PACKET)
+        {
+            dec->have = 0;
+            dec->synced = 0;
+            ++dec->dropped;
+            return 0;
+        }
+    }
+    if (dec->have < WIRE_HEADER || dec->have < dec->need)
+        return 0;
+    dec->have = 0;
+    return wire_decode(dec);
+}
+
+// push as much of the pending buffer as the port takes right now, without waiting
+void pump_pending(SerialPort hSerial)
+{
+#ifndef _WIN32
+    while (pending_len > 0)
+    {
+        const uint64_t start = now_us();
+        const ssize_t n = write(hSerial, pending, pending_len);
+        if (n <= 0)
+            break;
+        record_write(n, now_us() - start);
+        pending += n;
+        pending_len -= n;
+    }
+#else
+    (void)hSerial;
+#endif
+}
+
+// send the buffer that has been packed so far and start packing into the other one
+void flush_batch(SerialPort hSerial)
+{
+    if (batch_fill == 0)
+        return;
+
+    // the other buffer has to be out before it gets reused
+    if (pending_len > 0)
+        write_serial(hSerial, pending, pending_len);
+    pending_len = 0;
+
+#ifdef _WIN32
+    write_serial(hSerial, batch_buf[batch_current], batch_fill);
+#else
+    pending = batch_buf[batch_current];
+    pending_len = batch_fill;
+    pump_pending(hSerial);
+#endif
+    batch_current ^= 1;
+    batch_fill = 0;
+}
+
+// under WIRE_COMPRESSED, makes sure the worst case packet fits in the batch. small batch sizes send one packet a write
+static inline void make_room_for_packet(SerialPort hSerial)
+{
+    const int limit = batch_bytes > WIRE_MAX_PACKET ? batch_bytes : WIRE_MAX_PACKET;
+    if (batch_fill + WIRE_MAX_PACKET > limit)
+        flush_batch(hSerial);
+}
+
+void pack_arr(SerialPort hSerial, const Data *const data_array)
+{
+    pump_pending(hSerial);
+    clock_samples_out(256);
+    if (wire_format == WIRE_COMPRESSED)
+    {
+        make_room_for_packet(hSerial);
+        pack(data_array, wire_frames, 256 * 8);
+        batch_fill += wire_encode(&wire_enc, wire_frames, 256, &batch_buf[batch_current][batch_fill]);
+        stats.bytes_queued = batch_fill + pending_len;
+        return;
+    }
     for (int j = 0; j < 256; j += 32)
     {
-        pack(&data_array[j], packed, 256);
-        WriteFile(hSerial, packed, 256, &bytesWritten, NULL);
+        if (batch_fill + 256 > batch_bytes)
+            flush_batch(hSerial);
+        pack(&data_array[j], &batch_buf[batch_current][batch_fill], 256);
+        batch_fill += 256;
+    }
+    stats.bytes_queued = batch_fill + pending_len;
+}
+
+// pack_arr() for samples kept as one array per field
+void pack_arr_arrays(SerialPort hSerial, const DataArrays *const d, const int count)
+{
+    pump_pending(hSerial);
+    clock_samples_out(count);
+    for (int j = 0; j < count;)
+    {
+        int n;
+        if (wire_format == WIRE_COMPRESSED)
+        {
+            make_room_for_packet(hSerial);
+            n = count - j < WIRE_MAX_SAMPLES ? count - j : WIRE_MAX_SAMPLES;
+        }
+        else
+        {
+            if (batch_fill + 256 > batch_bytes)
+                flush_batch(hSerial);
+
+            // as many samples as fit in the batch
+            n = (batch_bytes - batch_fill) / 8;
+            if (n > count - j)
+                n = count - j;
+        }
+        const DataArrays chunk = {d->r + j, d->g + j, d->b + j, d->laser_x + j, d->laser_y + j, d->audio_l + j, d->audio_r + j};
+        const uint64_t start = now_us();
+        if (wire_format == WIRE_COMPRESSED)
+        {
+            pack_arrays(&chunk, wire_frames, n);
+            batch_fill += wire_encode(&wire_enc, wire_frames, n, &batch_buf[batch_current][batch_fill]);
+        }
+        else
+        {
+            pack_arrays(&chunk, &batch_buf[batch_current][batch_fill], n);
+            batch_fill += n * 8;
+        }
+        const uint64_t us = now_us() - start;
+        stats.pack_us += us;
+        stats.pack_max_us = us > stats.pack_max_us ? us : stats.pack_max_us;
+        j += n;
+    }
+    stats.bytes_queued = batch_fill + pending_len;
+}
+
+// pack_arr() for frames that are packed already
+void pack_arr_packed(SerialPort hSerial, const uint8_t *const frames, const int count)
+{
+    pump_pending(hSerial);
+    clock_samples_out(count);
+    for (int j = 0; j < count;)
+    {
+        int n;
+        if (wire_format == WIRE_COMPRESSED)
+            make_room_for_packet(hSerial);
+        else if (batch_fill + 256 > batch_bytes)
+            flush_batch(hSerial);
+
+        const uint64_t start = now_us();
+        if (wire_format == WIRE_COMPRESSED)
+        {
+            n = count - j < WIRE_MAX_SAMPLES ? count - j : WIRE_MAX_SAMPLES;
+            batch_fill += wire_encode(&wire_enc, &frames[j * 8], n, &batch_buf[batch_current][batch_fill]);
+        }
+        else
+        {
+            n = (batch_bytes - batch_fill) / 8;
+            if (n > count - j)
+                n = count - j;
+            memcpy(&batch_buf[batch_current][batch_fill], &frames[j * 8], n * 8);
+            batch_fill += n * 8;
+        }
+        const uint64_t us = now_us() - start;
+        stats.pack_us += us;
+        stats.pack_max_us = us > stats.pack_max_us ? us : stats.pack_max_us;
+        j += n;
+    }
+    stats.bytes_queued = batch_fill + pending_len;
+}
+
+// bytes per batch, rounded down to whole 32 sample chunks. 256 writes every chunk on its own
+void set_batch_size(int bytes)
+{
+    bytes -= bytes % 256;
+    batch_bytes = bytes < 256 ? 256 : (bytes > MAX_BATCH_BYTES ? MAX_BATCH_BYTES : bytes);
+}
+
+// write out everything that has been packed, for when nothing else is coming for a while
+void flush_laser()
+{
+    flush_batch(serial_conn);
+    if (pending_len > 0)
+        write_serial(serial_conn, pending, pending_len);
+    pending_len = 0;
+    stats.bytes_queued = 0;
+}
+
+// WIRE_RAW or WIRE_COMPRESSED, whichever the laser is expecting. what was packed in the old
+// format goes out first, and a compressed stream always starts with a keyframe
+void set_wire_format(const int format)
+{
+    flush_laser();
+    wire_format = format == WIRE_COMPRESSED ? WIRE_COMPRESSED : WIRE_RAW;
+    wire_enc.since_key = WIRE_KEY_INTERVAL;
+}
+
+double bytes_per_write()
+{
+    return stats.writes ? (double)stats.bytes_written / stats.writes : 0;
+}
+
+// the live counters, Python maps this once and reads it whenever it likes
+LaserStats *laser_stats()
+{
+    return &stats;
+}
+
+void reset_laser_stats()
+{
+    const uint64_t queued = stats.bytes_queued;
+    memset(&stats, 0, sizeof(stats));
+    stats.bytes_queued = queued;
+    clock_samples = 0;
+}
+
+void print_laser_stats()
+{
+    const double frames = stats.frames ? (double)stats.frames : 1;
+    printf("%llu samples, %llu late, %llu underruns\n", (unsigned long long)stats.samples,
+        (unsigned long long)stats.samples_late, (unsigned long long)stats.underruns);
+    if (stats.samples)
+        printf("%.2f bytes per sample on the wire\n", (double)stats.bytes_written / stats.samples);
+    if (stats.frames_looped)
+        printf("%llu of %llu frames played from a loop\n", (unsigned long long)stats.frames_looped, (unsigned long long)stats.frames);
+    printf("render %.1f us/frame (worst %llu), pack %.1f us/frame (worst %llu), write %.1f us/call (worst %llu)\n",
+        stats.render_us / frames, (unsigned long long)stats.render_max_us, stats.pack_us / frames, (unsigned long long)stats.pack_max_us,
+        stats.writes ? (double)stats.write_us / stats.writes : 0, (unsigned long long)stats.write_max_us);
+}
+
+#ifndef _WIN32
+speed_t baud_to_speed(int baud)
+{
+    switch (baud)
+    {
+    case 115200:  return B115200;
+    case 230400:  return B230400;
+    case 460800:  return B460800;
+    case 500000:  return B500000;
+    case 921600:  return B921600;
+    case 1000000: return B1000000;
+    case 2000000: return B2000000;
+    default:
+        fprintf(stderr, "Unsupported baud rate %d\n", baud);
+        exit(0);
     }
 }
+#endif
 
-HANDLE setup_serial()
+// picks the port setup_serial() opens. call before send_to_laser(0, ...)
+void set_serial_port(const char *const device, int baud)
 {
-    HANDLE hSerial = CreateFileA("\\\\.\\COM3", GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0);
+    if (device != NULL)
+        snprintf(serial_device, sizeof(serial_device), "%s", device);
+    if (baud > 0)
+        serial_baud = baud;
+}
+
+SerialPort setup_serial()
+{
+#ifdef _WIN32
+    HANDLE hSerial = CreateFileA(serial_device, GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0);
     if (hSerial == INVALID_HANDLE_VALUE) 
     {
-        fprintf(stderr, "Error opening COM3\n");
+        fprintf(stderr, "Error opening %s\n", serial_device);
         exit(0);
     }
 
     DCB dcbSerialParams = {0};
     dcbSerialParams.DCBlength = sizeof(dcbSerialParams);
     GetCommState(hSerial, &dcbSerialParams);
-    dcbSerialParams.BaudRate = 1000000;//CBR_115200;
+    dcbSerialParams.BaudRate = serial_baud;
     dcbSerialParams.ByteSize = 8;
     dcbSerialParams.StopBits = ONESTOPBIT;
     dcbSerialParams.Parity   = NOPARITY;
     SetCommState(hSerial, &dcbSerialParams);
 
     return hSerial;
+#else
+    const int fd = open(serial_device, O_WRONLY | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error opening %s\n", serial_device);
+        exit(0);
+    }
+
+    // raw 8N1 at serial_baud
+    struct termios tty;
+    if (tcgetattr(fd, &tty) == 0)
+    {
+        cfmakeraw(&tty);
+        cfsetospeed(&tty, baud_to_speed(serial_baud));
+        cfsetispeed(&tty, baud_to_speed(serial_baud));
+        tty.c_cflag &= ~(PARENB | CSTOPB | CRTSCTS);
+        tty.c_cflag |= CS8 | CLOCAL;
+        tcsetattr(fd, TCSANOW, &tty);
+    }
+    return fd;
+#endif
+}
+
+void close_serial(SerialPort hSerial)
+{
+#ifdef _WIN32
+    CloseHandle(hSerial);
+#else
+    close(hSerial);
+#endif
 }
 
-void square(HANDLE hSerial, const int width, int r, int g, int b, int del)
+void square(SerialPort hSerial, const int width, int r, int g, int b, int del)
 {
     static Data data_array[256] = {0};
-    static uint8_t packed[256] = {0};
     const int mult = 40;
 
     for (int i = 0, j = 0; j < 256; ++i, ++j)
@@ -147,7 +1120,7 @@ void square(HANDLE hSerial, const int width, int r, int g, int b, int del)
         }
         if (i == 256)
         {
-            pack_arr(hSerial, data_array, packed);
+            pack_arr(hSerial, data_array);
             i = 0;
         }
         for (int d = 0; d < del && i < 256; ++d, ++i)
@@ -162,7 +1135,7 @@ void square(HANDLE hSerial, const int width, int r, int g, int b, int del)
         }
         if (i == 256)
         {
-            pack_arr(hSerial, data_array, packed);
+            pack_arr(hSerial, data_array);
             i = 0;
         }
         
@@ -178,7 +1151,7 @@ void square(HANDLE hSerial, const int width, int r, int g, int b, int del)
         }
         if (i == 256)
         {
-            pack_arr(hSerial, data_array, packed);
+            pack_arr(hSerial, data_array);
             i = 0;
         }
         
@@ -194,7 +1167,7 @@ void square(HANDLE hSerial, const int width, int r, int g, int b, int del)
         }
         if (i == 256)
         {
-            pack_arr(hSerial, data_array, packed);
+            pack_arr(hSerial, data_array);
             i = 0;
         }
     }
@@ -207,10 +1180,9 @@ int get_microseconds()
     return (int)(tv.tv_sec * 1000000 + tv.tv_usec);
 }
 
-void geometry(HANDLE hSerial, float xp, float yp, float xamp, float yamp, int t, int r, int g, int b)
+void geometry(SerialPort hSerial, float xp, float yp, float xamp, float yamp, int t, int r, int g, int b)
 {    
     static Data data_array[256] = {0};
-    static uint8_t packed[256] = {0};
 
     xamp = 4090 * xamp/2;
     yamp = 4090 * yamp/2;
@@ -233,7 +1205,7 @@ void geometry(HANDLE hSerial, float xp, float yp, float xamp, float yamp, int t,
             else if (data_array[j].laser_y < 0)
                 data_array[j].laser_y = 0;
         }
-        pack_arr(hSerial, data_array, packed);
+        pack_arr(hSerial, data_array);
     }
 }
 
@@ -254,74 +1226,192 @@ void rotate_point(uint16_t *x, uint16_t *y, float angle, float cx, float cy)
 }
 
 
-void send_to_laser(const int len, const float *const arr, const int *const types, int first_one)
+// sin() of a phase in Oscillator scale. folded into [-pi/2, pi/2] and a 9th order polynomial,
+// no branches so the loops using it vectorize.
+static inline float sin_phase(const uint32_t phase)
 {
-    if (len == 0)
+    const int32_t flip = (int32_t)(phase ^ (phase << 1)) >> 31; // -1 when the angle is past +-pi/2
+    const int32_t folded = ((int32_t)(0x80000000u - phase) & flip) | ((int32_t)phase & ~flip);
+    const float x = folded * (6.2831853f / 4294967296.0f);
+    const float x2 = x * x;
+    return x * (1.0f + x2 * (-1.0f / 6 + x2 * (1.0f / 120 + x2 * (-1.0f / 5040 + x2 * (1.0f / 362880)))));
+}
+
+// adds (sin + 1) * amp + 0.5 to 256 samples of 'out'. frequency and amplitude glide from
+// the last call to this one over the frame, so changing them never makes the wave jump.
+// hz as an Oscillator increment
+static inline uint32_t phase_inc(const float hz)
+{
+    double turns = (double)hz / ISR_HZ;
+    turns -= floor(turns);
+    return (uint32_t)(uint64_t)(turns * 4294967296.0);
+}
+
+void oscillate(Oscillator *const osc, uint16_t *const out, const float hz, const float amp)
+{
+    const uint32_t inc = phase_inc(hz);
+
+    if (!osc->live)
     {
-        serial_conn = setup_serial();
-        return;
+        osc->inc = inc;
+        osc->amp = amp;
     }
 
-    static int t = 0;
-    static Data data_array[256] = {0};
-    static uint8_t packed[256] = {0};
-    float amp, p;
-    memset(data_array, 0, sizeof(data_array));
+    // the increment moves by 'step' / 256 every sample, which sums to step * j * (j + 1) / 512
+    const uint32_t phase = osc->phase, start_inc = osc->inc;
+    const int64_t step = (int32_t)(inc - start_inc);
+    const float start_amp = osc->amp, amp_step = (amp - osc->amp) / 256;
+    for (int j = 0; j < 256; ++j)
+    {
+        const uint32_t p = phase + (uint32_t)j * start_inc + (uint32_t)((step * (j * (j + 1) / 2)) >> 8);
+        out[j] += (sin_phase(p) + 1) * (start_amp + amp_step * (j + 1)) + 0.5f;
+    }
 
-    if (first_one)
-        t = 0;
+    osc->phase = phase + 256u * start_inc + (uint32_t)((step * (256 * 257 / 2)) >> 8);
+    osc->inc = inc;
+    osc->amp = amp;
+    osc->live = 1;
+}
+
+// oscillate() with hz and amp each going from the first value to the second by the weights in 'w', one per sample
+void oscillate_blend(Oscillator *const osc, uint16_t *const out, const float hz0, const float hz1,
+                     const float amp0, const float amp1, const float *const w)
+{
+    const uint32_t inc0 = phase_inc(hz0);
+    const double inc_step = (int32_t)(phase_inc(hz1) - inc0); // the short way round
+    uint32_t phase = osc->phase, inc = inc0;
+    float amp = amp0;
+    for (int j = 0; j < 256; ++j)
+    {
+        inc = inc0 + (uint32_t)(int64_t)(inc_step * w[j]);
+        amp = amp0 + (amp1 - amp0) * w[j];
+        out[j] += (sin_phase(phase) + 1) * amp + 0.5f;
+        phase += inc;
+    }
+    osc->phase = phase;
+    osc->inc = inc;
+    osc->amp = amp;
+    osc->live = 1;
+}
+
+static inline float ease(const int easing, const float t)
+{
+    switch (easing)
+    {
+    case EASE_IN_SINE:     return 1 - cosf(t * 1.5707963f);
+    case EASE_OUT_SINE:    return sinf(t * 1.5707963f);
+    case EASE_IN_OUT_SINE: return 0.5f - 0.5f * cosf(t * 3.1415927f);
+    default:               return t;
+    }
+}
+
+// parameter i of a frame, on its way to 'to' when there are weights
+static inline float blend(const float *const arr, const float *const to, const float *const w, const int i, const int j)
+{
+    return w ? arr[i] + (to[i] - arr[i]) * w[j] : arr[i];
+}
+
+// one XHZ / YHZ / AUDIO entry, hz and amp at arr[i] and arr[i+1]
+static inline void wave(Oscillator *const osc, uint16_t *const out, const float *const arr, const float *const to,
+                        const float *const w, const int i)
+{
+    if (w)
+        oscillate_blend(osc, out, arr[i], to[i], 4095/2 * arr[i+1], 4095/2 * to[i+1], w);
+    else
+        oscillate(osc, out, arr[i], 4095/2 * arr[i+1]);
+}
+
+static inline void record_render(const uint64_t us)
+{
+    ++stats.frames;
+    stats.render_us += us;
+    stats.render_max_us = us > stats.render_max_us ? us : stats.render_max_us;
+    add_time(stats.render_hist, us);
+}
+
+// number of values send_to_laser() reads from 'arr' for each of 'types'
+int params_per_frame(const int len, const int *const types)
+{
+    int n = 0;
+    for (int type = 0; type < len; ++type)
+        n += types[type] == XHZ || types[type] == YHZ || types[type] == AUDIO_L || types[type] == AUDIO_R ? 2 : (types[type] == ROTATE ? 3 : 1);
+    return n;
+}
+
+// one frame of send_to_laser() into render_data. with weights 'w' every parameter moves from 'arr'
+// towards the same one in 'to' sample by sample, otherwise only waves glide, from the last call's values
+void render_frame(const int len, const float *const arr, const int *const types, const float *const to, const float *const w)
+{
+    uint8_t *const r = render_r, *const g = render_g, *const b = render_b;
+    uint16_t *const laser_x = render_x, *const laser_y = render_y, *const audio_l = render_al, *const audio_r = render_ar;
+    int osc = 0;
+    memset(render_r, 0, sizeof(render_r));
+    memset(render_g, 0, sizeof(render_g));
+    memset(render_b, 0, sizeof(render_b));
+    memset(render_x, 0, sizeof(render_x));
+    memset(render_y, 0, sizeof(render_y));
+    memset(render_al, 0, sizeof(render_al));
+    memset(render_ar, 0, sizeof(render_ar));
 
     for (int i = 0, type = 0; type < len; ++i, type++)
     {
         switch (types[type])
         {
         case XHZ:
-            amp = 4095/2 * arr[i+1];
-            p = 2*  3.1415926 * arr[i] / ISR_HZ;
-            for (int j = 0, k = t; j < 256; ++j, ++k)
-                data_array[j].laser_x += (sinf(k * p) + 1) * amp + 0.5f;
+            if (osc < MAX_OSCILLATORS)
+                wave(&oscillators[osc++], laser_x, arr, to, w, i);
             ++i;
             break;
 
         case YHZ:
-            amp = 4095/2 * arr[i+1];
-            p = 2 * 3.1415926*  arr[i] / ISR_HZ;
-            for (int j = 0, k = t; j < 256; ++j, ++k)
-                data_array[j].laser_y += (sinf(k * p) + 1) * amp + 0.5f;
+            if (osc < MAX_OSCILLATORS)
+                wave(&oscillators[osc++], laser_y, arr, to, w, i);
             ++i;
             break;
 
         case RED:
             for (int j = 0; j < 256; ++j)
-                data_array[j].r = (int)(arr[i] + 0.5f);
+                r[j] = (int)(blend(arr, to, w, i, j) + 0.5f);
             break;
 
         case GREEN:
             for (int j = 0; j < 256; ++j)
-                data_array[j].g = (int)(arr[i] + 0.5f);
+                g[j] = (int)(blend(arr, to, w, i, j) + 0.5f);
             break;
 
         case BLUE:
             for (int j = 0; j < 256; ++j)
-                data_array[j].b = (int)(arr[i] + 0.5f);
+                b[j] = (int)(blend(arr, to, w, i, j) + 0.5f);
             break;
 
         case XOFF:
-            for (int j = 0, k = t; j < 256; ++j, ++k)
-                data_array[j].laser_x += arr[i];
+            for (int j = 0; j < 256; ++j)
+                laser_x[j] += blend(arr, to, w, i, j);
             break;
 
         case YOFF:
-            for (int j = 0, k = t; j < 256; ++j, ++k)
-                data_array[j].laser_y += arr[i];
+            for (int j = 0; j < 256; ++j)
+                laser_y[j] += blend(arr, to, w, i, j);
             break;
 
         case ROTATE:
-            for (int j = 0, k = t; j < 256; ++j, ++k)
-                rotate_point(&data_array[j].laser_x, &data_array[j].laser_y, arr[i], arr[i+1], arr[i+2]);
+            for (int j = 0; j < 256; ++j)
+                rotate_point(&laser_x[j], &laser_y[j], blend(arr, to, w, i, j), blend(arr, to, w, i + 1, j), blend(arr, to, w, i + 2, j));
             i += 2;
             break;
 
+        case AUDIO_L:
+            if (osc < MAX_OSCILLATORS)
+                wave(&oscillators[osc++], audio_l, arr, to, w, i);
+            ++i;
+            break;
+
+        case AUDIO_R:
+            if (osc < MAX_OSCILLATORS)
+                wave(&oscillators[osc++], audio_r, arr, to, w, i);
+            ++i;
+            break;
+
         default:
             break;
         }
@@ -329,31 +1419,796 @@ void send_to_laser(const int len, const float *const arr, const int *const types
 
     for (int j = 0; j < 256; ++j)
     {
-        if (data_array[j].laser_y > 4095)
-            data_array[j].laser_y = 4095;
-        else if (data_array[j].laser_y < 0)
-            data_array[j].laser_y = 0;
+        if (laser_y[j] > 4095)
+            laser_y[j] = 4095;
+        else if (laser_y[j] < 0)
+            laser_y[j] = 0;
 
-        if (data_array[j].laser_x > 4095)
-            data_array[j].laser_x = 4095;
-        else if (data_array[j].laser_x < 0)
-            data_array[j].laser_x = 0;
+        if (laser_x[j] > 4095)
+            laser_x[j] = 4095;
+        else if (laser_x[j] < 0)
+            laser_x[j] = 0;
+
+        if (audio_l[j] > 4095)
+            audio_l[j] = 4095;
+        if (audio_r[j] > 4095)
+            audio_r[j] = 4095;
     }
     
-    pack_arr(serial_conn, data_array, packed);
-    t += 256;
+    // oscillators this call didn't use start fresh if they come back
+    for (; osc < MAX_OSCILLATORS; ++osc)
+        oscillators[osc].live = 0;
+}
+
+// whether this call repeats the last one, and so may be played from the loop
+int same_call(const int len, const float *const arr, const int *const types, const int first_one)
+{
+    const int n = params_per_frame(len, types);
+    if (first_one || loop_period < 0 || len > MAX_LOOP_TYPES || n > MAX_LOOP_PARAMS)
+    {
+        loop.len = -1;
+        return 0;
+    }
+    if (len == loop.len && memcmp(types, loop.types, len * sizeof(int)) == 0 && memcmp(arr, loop.arr, n * sizeof(float)) == 0)
+        return 1;
+
+    loop.len = len;
+    memcpy(loop.types, types, len * sizeof(int));
+    memcpy(loop.arr, arr, n * sizeof(float));
+    loop.tried = loop.samples = 0;
+    return 0;
+}
+
+// the fewest samples after which every oscillator in use is back within LOOP_ERROR counts of where it was,
+// 0 if there isn't one up to MAX_LOOP_SAMPLES. a set_loop_period() period is taken as it is
+int find_period()
+{
+    if (loop_period > 0)
+        return loop_period < MAX_LOOP_SAMPLES ? loop_period : MAX_LOOP_SAMPLES;
+
+    // the phase error each one may gather, an error of e turns moves it by 2 pi amp e counts
+    int32_t slack[MAX_OSCILLATORS];
+    for (int k = 0; k < loop.oscillators; ++k)
+    {
+        const double turns = oscillators[k].amp > 0 ? LOOP_ERROR / (6.2831853 * oscillators[k].amp) : 0.5;
+        slack[k] = (int32_t)(turns * 4294967295.0 < 2147483647.0 ? turns * 4294967295.0 : 2147483647.0);
+    }
+    for (int p = 1; p <= MAX_LOOP_SAMPLES; ++p)
+    {
+        int k = 0;
+        while (k < loop.oscillators && llabs((int32_t)((uint32_t)p * oscillators[k].inc)) <= slack[k])
+            ++k;
+        if (k == loop.oscillators)
+            return p;
+    }
+    return 0;
+}
+
+// renders a period of the held call into loop_packed, from where the oscillators are now, and leaves them there
+void make_loop(const int len, const float *const arr, const int *const types)
+{
+    loop.tried = 1;
+    loop.oscillators = 0;
+    while (loop.oscillators < MAX_OSCILLATORS && oscillators[loop.oscillators].live)
+        ++loop.oscillators;
+    const int period = find_period();
+    if (period == 0)
+        return;
+
+    Oscillator saved[MAX_OSCILLATORS];
+    memcpy(saved, oscillators, sizeof(oscillators));
+    for (int f = 0; f < (period + 511) / 256; ++f)
+    {
+        render_frame(len, arr, types, NULL, NULL);
+        pack_arrays(&render_data, &loop_packed[f * 256 * 8], 256);
+    }
+    memcpy(oscillators, saved, sizeof(oscillators));
+    for (int k = 0; k < loop.oscillators; ++k)
+        loop.phase[k] = oscillators[k].phase;
+    loop.samples = period;
+    loop.cursor = 0;
+}
+
+// 0 finds the period of a held call itself, -1 always renders live, anything else is used as the period
+void set_loop_period(const int samples)
+{
+    loop_period = samples;
+    loop.len = -1;
+}
+
+void send_to_laser(const int len, const float *const arr, const int *const types, int first_one)
+{
+    if (len == 0)
+    {
+        serial_conn = setup_serial();
+        return;
+    }
+
+    const uint64_t start = now_us();
+
+    // start every wave over from phase 0
+    if (first_one)
+        memset(oscillators, 0, sizeof(oscillators));
+
+    // a held call plays its loop. the waves are only moved to where the loop is, so a change picks up from there
+    const int held = same_call(len, arr, types, first_one);
+    if (held && loop.samples)
+    {
+        ++stats.frames;
+        ++stats.frames_looped;
+        pack_arr_packed(serial_conn, &loop_packed[loop.cursor * 8], 256);
+        loop.cursor = (loop.cursor + 256) % loop.samples;
+        for (int k = 0; k < loop.oscillators; ++k)
+            oscillators[k].phase = loop.phase[k] + (uint32_t)loop.cursor * oscillators[k].inc;
+        return;
+    }
+
+    render_frame(len, arr, types, NULL, NULL);
+    record_render(now_us() - start);
+    pack_arr_arrays(serial_conn, &render_data, 256);
+
+    // the second time in a row the waves have stopped gliding, so what follows is periodic
+    if (held && !loop.tried)
+    {
+        const uint64_t loop_start = now_us();
+        make_loop(len, arr, types);
+        stats.render_us += now_us() - loop_start;
+    }
+}
+
+// eases every parameter from 'from' to 'to' over 'samples' samples along an EASINGS curve, then sends
+// 'to' for the rest of the last frame. both are laid out like send_to_laser()'s 'arr' for the same 'types'
+void send_transition(const int len, const float *const from, const float *const to, const int *const types,
+                     const int samples, const int easing, int first_one)
+{
+    static float w[256];
+
+    // start every wave over from phase 0
+    if (first_one)
+        memset(oscillators, 0, sizeof(oscillators));
+    loop.len = -1;
+
+    for (int done = 0; done < samples; done += 256)
+    {
+        const uint64_t start = now_us();
+        for (int j = 0; j < 256; ++j)
+            w[j] = done + j + 1 >= samples ? 1 : ease(easing, (float)(done + j + 1) / samples);
+        render_frame(len, from, types, to, w);
+        record_render(now_us() - start);
+        pack_arr_arrays(serial_conn, &render_data, 256);
+    }
+}
+
+// send_to_laser() for 'frames' frames in one call. 'arr' holds one row of parameters per frame,
+// all using the same 'types'.
+void send_timeline(const int frames, const int len, const float *const arr, const int *const types, int first_one)
+{
+    const int stride = params_per_frame(len, types);
+    for (int f = 0; f < frames; ++f)
+        send_to_laser(len, &arr[f * stride], types, first_one && f == 0);
+}
+
+// sends 'count' samples straight from the caller's arrays, no copies.
+// x and y are 0 - 4095, r, g and b 0 - 31 like everywhere else. audio is left at 0.
+void send_samples(const int count, const uint16_t *const x, const uint16_t *const y,
+                  const uint8_t *const r, const uint8_t *const g, const uint8_t *const b)
+{
+    static const uint16_t silence[4096] = {0};
+    for (int i = 0; i < count; i += 4096)
+    {
+        const DataArrays data = {r + i, g + i, b + i, x + i, y + i, silence, silence};
+        pack_arr_arrays(serial_conn, &data, count - i < 4096 ? count - i : 4096);
+    }
+}
+
+// renders one candidate the way send_to_laser() would, with no offsets, and scores where the beam went
+void score_pattern(const ScoreJob *const job, const int c)
+{
+    uint32_t hist[SCORE_GRID * SCORE_GRID] = {0};
+    uint16_t x[256], y[256];
+    Oscillator osc[MAX_OSCILLATORS] = {0};
+    const int *const types = &job->types[c * job->waves];
+    const float *const hz = &job->hz[c * job->waves], *const amp = &job->amp[c * job->waves];
+
+    for (int done = 0; done < job->samples; done += 256)
+    {
+        memset(x, 0, sizeof(x));
+        memset(y, 0, sizeof(y));
+        for (int w = 0, n = 0; w < job->waves && n < MAX_OSCILLATORS; ++w)
+            if (types[w] == XHZ || types[w] == YHZ)
+                oscillate(&osc[n++], types[w] == XHZ ? x : y, hz[w], 4095/2 * amp[w]);
+
+        const int n = job->samples - done < 256 ? job->samples - done : 256;
+        for (int j = 0; j < n; ++j)
+        {
+            const int cx = (x[j] > 4095 ? 4095 : x[j]) * SCORE_GRID / 4096;
+            const int cy = (y[j] > 4095 ? 4095 : y[j]) * SCORE_GRID / 4096;
+            ++hist[cy * SCORE_GRID + cx];
+        }
+    }
+
+    int covered = 0, x0 = SCORE_GRID, x1 = -1, y0 = SCORE_GRID, y1 = -1;
+    double entropy = 0;
+    for (int cy = 0; cy < SCORE_GRID; ++cy)
+        for (int cx = 0; cx < SCORE_GRID; ++cx)
+        {
+            const uint32_t h = hist[cy * SCORE_GRID + cx];
+            if (h == 0)
+                continue;
+            ++covered;
+            x0 = cx < x0 ? cx : x0;
+            x1 = cx > x1 ? cx : x1;
+            y0 = cy < y0 ? cy : y0;
+            y1 = cy > y1 ? cy : y1;
+            const double p = (double)h / job->samples;
+            entropy -= p * log(p);
+        }
+
+    uint64_t same_x = 0, same_y = 0, same_r = 0;
+    for (int cy = y0; cy <= y1; ++cy)
+        for (int cx = x0; cx <= x1; ++cx)
+        {
+            const uint32_t h = hist[cy * SCORE_GRID + cx];
+            const uint32_t mx = hist[cy * SCORE_GRID + x0 + x1 - cx];
+            const uint32_t my = hist[(y0 + y1 - cy) * SCORE_GRID + cx];
+            const uint32_t mr = hist[(y0 + y1 - cy) * SCORE_GRID + x0 + x1 - cx];
+            same_x += h < mx ? h : mx;
+            same_y += h < my ? h : my;
+            same_r += h < mr ? h : mr;
+        }
+
+    PatternScore *const s = &job->out[c];
+    s->coverage = (float)covered / (SCORE_GRID * SCORE_GRID);
+    s->fill = covered ? (float)covered / ((x1 - x0 + 1) * (y1 - y0 + 1)) : 0;
+    s->density = covered > 1 ? entropy / log(covered) : 1;
+    s->symmetry_x = (float)same_x / job->samples;
+    s->symmetry_y = (float)same_y / job->samples;
+    s->symmetry_r = (float)same_r / job->samples;
+}
+
+void *score_worker(void *arg)
+{
+    ScoreJob *const job = arg;
+    for (int c; (c = atomic_fetch_add(&job->next, 1)) < job->count;)
+        score_pattern(job, c);
+    return NULL;
+}
+
+#ifdef _WIN32
+DWORD WINAPI score_thread(LPVOID arg)
+{
+    score_worker(arg);
+    return 0;
+}
+#endif
+
+// scores 'count' candidate patterns without touching the laser, 'samples' samples of each.
+// types, hz and amp are count x waves, row by row, like one send_to_laser() call per row with amp 0 - 1.
+// threads <= 0 uses one per processor
+void score_patterns(const int count, const int waves, const int *const types, const float *const hz, const float *const amp,
+                    const int samples, int threads, PatternScore *const out)
+{
+    ScoreJob job = {.count = count, .waves = waves, .samples = samples > 0 ? samples : ISR_HZ / 10,
+                    .types = types, .hz = hz, .amp = amp, .out = out};
+    atomic_init(&job.next, 0);
+
+    if (threads <= 0)
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        threads = info.dwNumberOfProcessors;
+#else
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    }
+    threads = threads < 1 ? 1 : (threads > MAX_SCORE_THREADS ? MAX_SCORE_THREADS : threads);
+    if (threads > count)
+        threads = count > 0 ? count : 1;
+
+    // the calling thread takes a share too. candidates go to whichever thread asks next,
+    // so if a thread can't be started the others, the caller included, score its share
+    int started = 0;
+#ifdef _WIN32
+    HANDLE workers[MAX_SCORE_THREADS];
+    for (int t = 1; t < threads; ++t)
+        if ((workers[started] = CreateThread(NULL, 0, score_thread, &job, 0, NULL)) != NULL)
+            ++started;
+    score_worker(&job);
+    if (started > 0)
+        WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+    for (int t = 0; t < started; ++t)
+        CloseHandle(workers[t]);
+#else
+    pthread_t workers[MAX_SCORE_THREADS];
+    for (int t = 1; t < threads; ++t)
+        if (pthread_create(&workers[started], NULL, score_worker, &job) == 0)
+            ++started;
+    score_worker(&job);
+    for (int t = 0; t < started; ++t)
+        pthread_join(workers[t], NULL);
+#endif
+}
+
+// a complete message from a client, hand it to the renderer
+void publish_control(const ControlMessage *const msg)
+{
+    if (memcmp(msg->magic, CONTROL_MAGIC, 4) != 0)
+        return;
+    control_slots[control_back] = *msg;
+    control_back = atomic_exchange(&control_middle, control_back | CONTROL_FRESH) & 3;
+}
+
+Socket open_control_socket(const int port, const int udp)
+{
+    const Socket sock = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+        return INVALID_SOCKET;
+    const int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || (!udp && listen(sock, MAX_CONTROL_CLIENTS) != 0))
+    {
+        close_socket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// takes control messages on 'port' until the process ends. TCP connections are kept open,
+// and with 'udp' each datagram on the same port is a message as well.
+void *control_server(void *arg)
+{
+    const int port = ((const int*)arg)[0], udp = ((const int*)arg)[1];
+    const Socket listener = open_control_socket(port, 0);
+    const Socket datagrams = udp ? open_control_socket(port, 1) : INVALID_SOCKET;
+    if (listener == INVALID_SOCKET || (udp && datagrams == INVALID_SOCKET))
+    {
+        fprintf(stderr, "Can't listen on port %d\n", port);
+        exit(1);
+    }
+    printf("Laser control server listening on port %d%s\n", port, udp ? " (tcp and udp)" : "");
+
+    // messages arrive in pieces over TCP, each client fills its own until it is whole
+    Socket clients[MAX_CONTROL_CLIENTS];
+    ControlMessage pending[MAX_CONTROL_CLIENTS];
+    int filled[MAX_CONTROL_CLIENTS];
+    for (int c = 0; c < MAX_CONTROL_CLIENTS; ++c)
+        clients[c] = INVALID_SOCKET;
+
+    for (;;)
+    {
+        fd_set ready;
+        FD_ZERO(&ready);
+        FD_SET(listener, &ready);
+        Socket top = listener;
+        if (udp)
+        {
+            FD_SET(datagrams, &ready);
+            top = datagrams > top ? datagrams : top;
+        }
+        for (int c = 0; c < MAX_CONTROL_CLIENTS; ++c)
+        {
+            if (clients[c] == INVALID_SOCKET)
+                continue;
+            FD_SET(clients[c], &ready);
+            top = clients[c] > top ? clients[c] : top;
+        }
+        if (select((int)top + 1, &ready, NULL, NULL, NULL) < 0)
+            continue;
+
+        if (FD_ISSET(listener, &ready))
+        {
+            const Socket conn = accept(listener, NULL, NULL);
+            int c = 0;
+            while (c < MAX_CONTROL_CLIENTS && clients[c] != INVALID_SOCKET)
+                ++c;
+            if (c == MAX_CONTROL_CLIENTS)
+                close_socket(conn);
+            else if (conn != INVALID_SOCKET)
+            {
+                clients[c] = conn;
+                filled[c] = 0;
+            }
+        }
+
+        if (udp && FD_ISSET(datagrams, &ready))
+        {
+            ControlMessage msg;
+            if (recv(datagrams, (char*)&msg, sizeof(msg), 0) == (int)sizeof(msg))
+                publish_control(&msg);
+        }
+
+        for (int c = 0; c < MAX_CONTROL_CLIENTS; ++c)
+        {
+            if (clients[c] == INVALID_SOCKET || !FD_ISSET(clients[c], &ready))
+                continue;
+            const int got = recv(clients[c], (char*)&pending[c] + filled[c], sizeof(ControlMessage) - filled[c], 0);
+            if (got <= 0)
+            {
+                close_socket(clients[c]);
+                clients[c] = INVALID_SOCKET;
+                continue;
+            }
+            filled[c] += got;
+            if (filled[c] < (int)sizeof(ControlMessage))
+                continue;
+            filled[c] = 0;
+            if (memcmp(pending[c].magic, CONTROL_MAGIC, 4) != 0)
+            {
+                // out of step with the client, nothing after this can be trusted
+                close_socket(clients[c]);
+                clients[c] = INVALID_SOCKET;
+                continue;
+            }
+            publish_control(&pending[c]);
+        }
+    }
+    return NULL;
+}
+
+#ifdef _WIN32
+DWORD WINAPI control_thread(LPVOID arg)
+{
+    control_server(arg);
+    return 0;
+}
+#endif
+
+// plays whatever the control server last received, forever. the serial port sets the pace,
+// and a new message is picked up at the next 256 sample frame.
+// only returns, with -1, if the control server can't be started.
+int serve_laser(const int port, const int udp)
+{
+    static int args[2];
+    args[0] = port > 0 ? port : CONTROL_PORT;
+    args[1] = udp;
+
+    ControlMessage *const idle = &control_slots[control_front];
+    memcpy(idle->magic, CONTROL_MAGIC, 4);
+    idle->r = idle->g = idle->b = 128;
+
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+    const HANDLE server = CreateThread(NULL, 0, control_thread, args, 0, NULL);
+    if (server == NULL)
+    {
+        fprintf(stderr, "Error starting the control server\n");
+        return -1;
+    }
+    CloseHandle(server);
+#else
+    pthread_t server;
+    if (pthread_create(&server, NULL, control_server, args) != 0)
+    {
+        fprintf(stderr, "Error starting the control server\n");
+        return -1;
+    }
+    pthread_detach(server);
+#endif
+
+    float arr[MAX_PAIRS * 4 + 3];
+    int types[MAX_PAIRS * 2 + 3];
+    for (int first = 1;; first = 0)
+    {
+        if (atomic_load(&control_middle) & CONTROL_FRESH)
+            control_front = atomic_exchange(&control_middle, control_front) & 3;
+        const ControlMessage *const msg = &control_slots[control_front];
+
+        int len = 0, n = 0;
+        for (int i = 0; i < msg->x_count && i < MAX_PAIRS; ++i, ++len)
+        {
+            types[len] = XHZ;
+            arr[n++] = msg->x[i][0];
+            arr[n++] = msg->x[i][1];
+        }
+        for (int i = 0; i < msg->y_count && i < MAX_PAIRS; ++i, ++len)
+        {
+            types[len] = YHZ;
+            arr[n++] = msg->y[i][0];
+            arr[n++] = msg->y[i][1];
+        }
+        types[len++] = RED;
+        arr[n++] = msg->r;
+        types[len++] = GREEN;
+        arr[n++] = msg->g;
+        types[len++] = BLUE;
+        arr[n++] = msg->b;
+        send_to_laser(len, arr, types, first);
+    }
+}
+
+#ifndef _WIN32
+// stands in for the laser: a pseudo terminal whose far end is read back and decoded
+typedef struct
+{
+    int master;
+    pthread_t reader;
+    uint64_t bytes;
+    uint64_t frames;
+    uint64_t bad_frames; // the top bit of the second byte is never set by pack()
+    WireDecoder wire;    // under WIRE_COMPRESSED, bad_frames counts the packets it dropped
+    Data last;
+    int first_us, last_us;
+} Loopback;
+
+// makes serial_device point at a fresh pseudo terminal
+void open_loopback(Loopback *const lb)
+{
+    memset(lb, 0, sizeof(Loopback));
+    lb->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (lb->master < 0 || grantpt(lb->master) != 0 || unlockpt(lb->master) != 0)
+    {
+        fprintf(stderr, "Error opening a pseudo terminal\n");
+        exit(0);
+    }
+    set_serial_port(ptsname(lb->master), 0);
+}
+
+void *read_loopback(void *arg)
+{
+    Loopback *const lb = arg;
+    uint8_t buf[1 << 16];
+    uint8_t frame[8];
+    int have = 0;
+
+    for (;;)
+    {
+        // fails with EIO once the serial side is closed
+        const ssize_t n = read(lb->master, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        if (lb->bytes == 0)
+            lb->first_us = get_microseconds();
+        lb->last_us = get_microseconds();
+        lb->bytes += n;
+
+        for (ssize_t i = 0; i < n && wire_format == WIRE_COMPRESSED; ++i)
+        {
+            const int got = wire_feed(&lb->wire, buf[i]);
+            if (got > 0)
+                unpack(&lb->wire.frames[(got - 1) * 8], &lb->last);
+            lb->frames += got;
+            lb->bad_frames = lb->wire.dropped;
+        }
+        for (ssize_t i = 0; i < n && wire_format == WIRE_RAW; ++i)
+        {
+            frame[have++] = buf[i];
+            if (have < 8)
+                continue;
+            have = 0;
+            if (frame[1] & 0x80)
+                ++lb->bad_frames;
+            unpack(frame, &lb->last);
+            ++lb->frames;
+        }
+    }
+    return NULL;
+}
+
+void report_loopback(const Loopback *const lb)
+{
+    const double seconds = (lb->last_us - lb->first_us) / 1e6;
+    printf("%.0f bytes per write\n", bytes_per_write());
+    printf("sent %llu bytes, received %llu bytes, %llu frames, %llu bad\n",
+        (unsigned long long)stats.bytes_written, (unsigned long long)lb->bytes,
+        (unsigned long long)lb->frames, (unsigned long long)lb->bad_frames);
+    if (seconds > 0)
+        printf("%.0f frames per second (%.2fx real time)\n", lb->frames / seconds, lb->frames / seconds / ISR_HZ);
+    printf("last frame: r %d g %d b %d x %d y %d\n", lb->last.r, lb->last.g, lb->last.b, lb->last.laser_x, lb->last.laser_y);
+}
+#endif
+
+// checks pack_arrays() gives the same bytes as pack() on random samples, and times both
+int check_pack()
+{
+    const int count = (1 << 20) + 7; // not a whole number of vectors, so the tail is covered too
+    Data *const samples = malloc(count * sizeof(Data));
+    uint8_t *const r = malloc(count), *const g = malloc(count), *const b = malloc(count);
+    uint16_t *const x = malloc(count * 2), *const y = malloc(count * 2), *const al = malloc(count * 2), *const ar = malloc(count * 2);
+    uint8_t *const expected = malloc(count * 8), *const got = malloc(count * 8);
+
+    srand(1);
+    for (int i = 0; i < count; ++i)
+    {
+        samples[i].r = r[i] = rand();
+        samples[i].g = g[i] = rand();
+        samples[i].b = b[i] = rand();
+        samples[i].laser_x = x[i] = rand();
+        samples[i].laser_y = y[i] = rand();
+        samples[i].audio_l = al[i] = rand();
+        samples[i].audio_r = ar[i] = rand();
+    }
+    const DataArrays arrays = {r, g, b, x, y, al, ar};
+    memset(expected, 0, count * 8); // fault the pages in before timing
+    memset(got, 0, count * 8);
+
+    int start = get_microseconds();
+    pack(samples, expected, count * 8);
+    const int pack_us = get_microseconds() - start;
+
+    start = get_microseconds();
+    pack_arrays(&arrays, got, count);
+    const int arrays_us = get_microseconds() - start;
+
+    int mismatches = 0;
+    for (int i = 0; i < count; ++i)
+        if (memcmp(&expected[i * 8], &got[i * 8], 8) != 0 && mismatches++ == 0)
+            printf("first mismatch at sample %d\n", i);
+
+    printf("%d samples, %d mismatches\n", count, mismatches);
+    printf("pack() %d us, pack_arrays() %d us\n", pack_us, arrays_us);
+
+    free(samples);
+    free(r); free(g); free(b);
+    free(x); free(y); free(al); free(ar);
+    free(expected); free(got);
+    return mismatches == 0;
+}
+
+// encodes a few kinds of signal, decodes them again a byte at a time and checks every frame comes back exactly.
+// the last run flips a byte in the middle of the stream, which may cost samples up to the next keyframe but never a wrong one
+int check_wire()
+{
+    const char *const kinds[] = {"lissajous", "audio", "blanking", "noise", "damaged", "resync"};
+    const int count = ISR_HZ + 1; // a short last packet and vector tail. under 256 packets, so the sequence number places each one
+    int first[256]; // by sequence number, the first sample of the packet
+    uint8_t *const r = malloc(count), *const g = malloc(count), *const b = malloc(count);
+    uint16_t *const x = malloc(count * 2), *const y = malloc(count * 2), *const al = malloc(count * 2), *const ar = malloc(count * 2);
+    uint8_t *const frames = malloc(count * 8);
+    uint8_t *const wire = malloc((count / WIRE_MAX_SAMPLES + 32) * WIRE_MAX_PACKET);
+    WireDecoder *const dec = malloc(sizeof(WireDecoder));
+    const DataArrays arrays = {r, g, b, x, y, al, ar};
+    int wrong = 0;
+
+    srand(1);
+    for (int k = 0; k < 6; ++k)
+    {
+        int sx = 0, sy = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            const double t = (double)i / ISR_HZ;
+            x[i] = 2048 + 2000 * sin(2 * M_PI * 200 * t);
+            y[i] = 2048 + 2000 * sin(2 * M_PI * 301 * t);
+            r[i] = 20, g[i] = 12, b[i] = 31;
+            al[i] = ar[i] = 2048;
+            if (k == 1)
+            {
+                al[i] = 2048 + 2047 * sin(2 * M_PI * 440 * t);
+                ar[i] = 2048 + 2047 * sin(2 * M_PI * 660 * t);
+            }
+            if (k == 2)
+            {
+                // short lines from random points, blanked every other one
+                if (i % 100 == 0)
+                    sx = rand() % 3000, sy = rand() % 3000;
+                x[i] = sx + i % 100 * 10;
+                y[i] = sy + i % 100 * 7;
+                r[i] = g[i] = b[i] = (i / 100) % 2 ? 0 : 25;
+            }
+            if (k == 3)
+            {
+                r[i] = rand(), g[i] = rand(), b[i] = rand();
+                x[i] = rand(), y[i] = rand(), al[i] = rand(), ar[i] = rand();
+            }
+        }
+        pack_arrays(&arrays, frames, count);
+
+        // "resync" loses the packet before each keyframe, then sends a single sample when the keyframe is due,
+        // which goes out plain. the packet after it has to be a keyframe again.
+        WireEncoder enc = {.since_key = WIRE_KEY_INTERVAL};
+        size_t len = 0;
+        int lost = 0;
+        for (int i = 0, n = 0, packet = 0; i < count; i += n, ++packet)
+        {
+            const int single = k == 5 && i > 0 && n > 1 && enc.since_key >= WIRE_KEY_INTERVAL;
+            n = count - i < WIRE_MAX_SAMPLES ? count - i : WIRE_MAX_SAMPLES;
+            if (single)
+                n = 1;
+            const int drop = k == 5 && i > 0 && enc.since_key == WIRE_KEY_INTERVAL - 1;
+            first[packet & 255] = i;
+            const size_t at = len;
+            len += wire_encode(&enc, &frames[i * 8], n, &wire[len]);
+            if (drop)
+            {
+                len = at;
+                lost += n;
+            }
+        }
+        if (k == 4)
+            wire[len / 3] ^= 0x10;
+
+        memset(dec, 0, sizeof(WireDecoder));
+        int got = 0;
+        for (size_t i = 0; i < len; ++i)
+        {
+            const int n = wire_feed(dec, wire[i]);
+            const int at = first[(uint8_t)(dec->seq - 1)];
+            if (n > 0 && (at + n > count || memcmp(dec->frames, &frames[at * 8], n * 8) != 0))
+                wrong += n;
+            got += n;
+        }
+        if (k != 4 && got != count - lost)
+            wrong += abs(count - lost - got);
+
+        const double per_sample = (double)len / count;
+        printf("%-10s %5.2f bytes/sample, %4.1fx smaller, %6.0f samples/s at %d baud, %d of %d samples decoded\n",
+            kinds[k], per_sample, 8 / per_sample, serial_baud / 10.0 / per_sample, serial_baud, got, count);
+    }
+    printf("%d wrong samples\n", wrong);
+
+    free(r); free(g); free(b);
+    free(x); free(y); free(al); free(ar);
+    free(frames); free(wire); free(dec);
+    return wrong == 0;
 }
 
 // color: 31 - 255
+// --device path and --baud n pick the serial port, --batch n the bytes per write, --compress sends WIRE_COMPRESSED,
+// --loopback sends to a pseudo terminal instead, --check-pack compares pack_arrays() against pack(),
+// --check-wire round trips wire_encode() through the reference decoder, --loop n is set_loop_period(n),
+// --serve [port] plays what the control server receives, --udp takes control messages over udp as well
 int main(int argc, char **argv) 
 {
-    // HANDLE hSerial = setup_serial();
+    // SerialPort hSerial = setup_serial();
     // int start = get_microseconds();
 
     int r = 70, g = 70, b = 70, t = 100000;
     float xp = 200, yp = 301;
+    int loopback = 0, serve = 0, udp = 0;
     for (int i = 1; i < argc; ++i)
     {
+        if (strcmp(argv[i], "--serve") == 0)
+        {
+            serve = CONTROL_PORT;
+            if (i + 1 < argc && atoi(argv[i+1]) > 0)
+                serve = atoi(argv[++i]);
+            continue;
+        }
+        if (strcmp(argv[i], "--udp") == 0)
+        {
+            udp = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--device") == 0 && i + 1 < argc)
+        {
+            set_serial_port(argv[++i], 0);
+            continue;
+        }
+        if (strcmp(argv[i], "--baud") == 0 && i + 1 < argc)
+        {
+            set_serial_port(NULL, atoi(argv[++i]));
+            continue;
+        }
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+        {
+            set_batch_size(atoi(argv[++i]));
+            continue;
+        }
+        if (strcmp(argv[i], "--check-pack") == 0)
+            return check_pack() ? 0 : 1;
+        if (strcmp(argv[i], "--check-wire") == 0)
+            return check_wire() ? 0 : 1;
+        if (strcmp(argv[i], "--loop") == 0 && i + 1 < argc)
+        {
+            set_loop_period(atoi(argv[++i]));
+            continue;
+        }
+        if (strcmp(argv[i], "--compress") == 0)
+        {
+            set_wire_format(WIRE_COMPRESSED);
+            continue;
+        }
+        if (strcmp(argv[i], "--loopback") == 0)
+        {
+            loopback = 1;
+            continue;
+        }
         if (argv[i][0] == 'r')
         {
             r = atoi(argv[i+1]);
@@ -380,12 +2235,38 @@ int main(int argc, char **argv)
         }
     }
 
+#ifndef _WIN32
+    Loopback lb;
+    if (loopback)
+        open_loopback(&lb);
+#endif
+
     send_to_laser(0, NULL, NULL, 1);
 
+#ifndef _WIN32
+    if (loopback)
+        pthread_create(&lb.reader, NULL, read_loopback, &lb);
+#endif
+    if (serve && serve_laser(serve, udp) != 0)
+        return 1;
+
     float things[9] = {xp, 1, yp, 1, 400, .1, r, g, b};
     int types[6] = {XHZ, YHZ, XHZ, RED, GREEN, BLUE};
     for (int i = 0; i < 1000; ++i)
         send_to_laser(6, things, types, 0);
+
+#ifndef _WIN32
+    flush_laser();
+    if (loopback)
+    {
+        close_serial(serial_conn);
+        pthread_join(lb.reader, NULL);
+        report_loopback(&lb);
+        print_laser_stats();
+        close(lb.master);
+        return 0;
+    }
+#endif
     return 1;
 
     // geometry(hSerial, xp, yp, .9, .9, t, r, g, b);